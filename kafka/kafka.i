@@ -5,9 +5,18 @@
 
 %{
 	#include "wrapper.h"
+
+	/* An optional table can also be nil. */
+	#define kafka_istable_or_nil(L,n) (lua_istable(L,n) || lua_isnil(L,n))
 %}
 
 
+/* Pass this as the partition to let the partitioner of the topic select a
+ * partition.
+ */
+%constant int PARTITION_UA = RD_KAFKA_PARTITION_UA;
+
+
 %init
 {
 	/* Initialize the list of error codes. */
@@ -42,14 +51,75 @@
 %}
 
 
+/* This typemap passes the Lua state to the function. The function must create
+ * exactly two lua objects on the stack. They are passed as the return values
+ * to lua.
+ * No further checks are done!
+ */
+%typemap(in, numinputs=0) lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR
+%{
+	$1 = L;
+	SWIG_arg += 2;
+%}
+
+
 %typemap(in) (const char *pcBUFFER_IN, size_t sizBUFFER_IN)
 {
         size_t sizBuffer;
-        $1 = (char*)lua_tolstring(L, $argnum, &sizBuffer);
+        $1 = (char*)lua_tolstring(L, $input, &sizBuffer);
         $2 = sizBuffer;
 }
 
 
+/* This typemap is like the one above, but it passes the stack index of the
+ * string too. The function can use it to anchor the string.
+ */
+%typemap(in) (const char *pcBUFFER_IN, size_t sizBUFFER_IN, int iBUFFER_INDEX)
+{
+        size_t sizBuffer;
+        $1 = (char*)lua_tolstring(L, $input, &sizBuffer);
+        $2 = sizBuffer;
+        $3 = $input;
+}
+
+
+/* This typemap passes the stack index of an optional argument to the
+ * function. It is 0 if the argument is not present. The function can read a
+ * binary string from the stack without any copy.
+ */
+%typemap(default) (int iLUA_INDEX_OPTIONAL)
+%{
+	$1 = 0;
+%}
+%typemap(in) (int iLUA_INDEX_OPTIONAL)
+%{
+	$1 = $input;
+%}
+
+
+/* This typemap passes the stack index of an optional table to the
+ * function. It is 0 if the argument is not present. The function reads
+ * the table from the stack with this index.
+ */
+%typemap(default) (int iLUA_TABLE_INDEX_OPTIONAL)
+%{
+	$1 = 0;
+%}
+%typemap(in,checkfn="lua_istable") (int iLUA_TABLE_INDEX_OPTIONAL)
+%{
+	$1 = $input;
+%}
+
+
+/* This typemap makes a boolean argument optional. It is false if the
+ * argument is not present.
+ */
+%typemap(default) (bool fBOOL_OPTIONAL)
+%{
+	$1 = false;
+%}
+
+
 %typemap(in, numinputs=0) (char **ppcBUFFER_OUT, size_t *psizBUFFER_OUT)
 %{
 	char *pcOutputData;
@@ -132,12 +202,15 @@
 %{
         $1 = L;
 %}
+/* The optional table can be left out or set to nil. This allows further
+ * arguments after it, like "kafka.Producer(brokers, nil, true)".
+ */
 %typemap(default) (lua_State *ptLuaStateForTableAccessOptional) {
         $1 = NULL;
 }
-%typemap(in,checkfn="lua_istable") (lua_State *ptLuaStateForTableAccessOptional)
+%typemap(in,checkfn="kafka_istable_or_nil") (lua_State *ptLuaStateForTableAccessOptional)
 %{
-        $1 = L;
+        $1 = lua_isnil(L, $input) ? NULL : L;
 %}
 
 
@@ -160,4 +233,16 @@
 /* The "create_topic" method of the "Producer" object returns a new "Topic" object. It must be freed by the LUA interpreter. */
 %newobject Producer::create_topic;
 
+/* The "create_topic" method of the "ShardedProducer" object returns a new "ShardedTopic" object. It must be freed by the LUA interpreter. */
+%newobject ShardedProducer::create_topic;
+
+/* A "ShardedTopic" object can only be created by a "ShardedProducer". */
+%nodefaultctor ShardedTopic;
+
+/* The "consume_view" method of the "Consumer" object returns a new "Message" object. It must be freed by the LUA interpreter. */
+%newobject Consumer::consume_view;
+
+/* A "Message" object can only be created by a "Consumer". */
+%nodefaultctor Message;
+
 %include "wrapper.h"
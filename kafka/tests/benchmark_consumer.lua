@@ -0,0 +1,184 @@
+-- Measure the consumer throughput and the produce to consume round trip of
+-- the module against the mock cluster of librdkafka. No network and no
+-- broker are needed.
+--
+-- Usage: lua benchmark_consumer.lua [messages] [round trips]
+--
+-- The topic is filled once with the given number of messages. Then it is
+-- read with "consume", "consume_batch" and "consume_view". Each consumer
+-- uses its own group and starts at the earliest offset.
+local kafka = require 'kafka'
+
+local uiMessages = tonumber(arg and arg[1]) or 1000000
+local uiRoundTrips = tonumber(arg and arg[2]) or 1000
+local uiPayloadSize = 256
+local uiBatchSize = 1000
+local uiTimeoutMs = 120000
+local strTopic = 'benchmark_consumer'
+
+
+local function fillTopic(strBrokers)
+  local tProducer = kafka.Producer(strBrokers, {
+    ['linger.ms'] = 5,
+    ['queue.buffering.max.messages'] = 1000000
+  })
+  local tTopic = tProducer:create_topic(strTopic)
+  local strPayload = string.rep('p', uiPayloadSize)
+  local atBatch = {}
+  local uiSent = 0
+  while uiSent<uiMessages do
+    local uiChunk = math.min(uiBatchSize, uiMessages-uiSent)
+    for uiCnt = 1, uiChunk do
+      atBatch[uiCnt] = strPayload
+    end
+    for uiCnt = uiChunk+1, #atBatch do
+      atBatch[uiCnt] = nil
+    end
+    local uiAccepted = tTopic:send_batch(atBatch)
+    uiSent = uiSent + uiAccepted
+    if uiAccepted<uiChunk then
+      tProducer:poll(10)
+    else
+      tProducer:poll(0)
+    end
+  end
+  local tResult, strError = tProducer:flush(uiTimeoutMs)
+  if tResult~=0 then
+    error(string.format('Failed to flush: %s', strError))
+  end
+end
+
+
+-- Read all messages with one consume mode. This returns the messages per
+-- second.
+local function consumeAll(strBrokers, strMode)
+  local tConsumer = kafka.Consumer(strBrokers, 'benchmark_' .. strMode, {
+    ['auto.offset.reset'] = 'earliest'
+  })
+  tConsumer:subscribe({ strTopic })
+
+  local atMessages = {}
+  local uiReceived = 0
+  local dStart = kafka.monotonic_us()
+  local dTimeout = dStart + uiTimeoutMs*1000
+  while uiReceived<uiMessages do
+    if kafka.monotonic_us()>dTimeout then
+      error(string.format('%s: only %d of %d messages received.', strMode, uiReceived, uiMessages))
+    end
+
+    if strMode=='consume' then
+      local tMessage = tConsumer:consume(100)
+      if tMessage~=nil and tMessage.error==nil then
+        uiReceived = uiReceived + 1
+      end
+    elseif strMode=='consume_batch' then
+      local uiCnt = tConsumer:consume_batch(uiBatchSize, 100, atMessages)
+      for uiIdx = 1, uiCnt do
+        if atMessages[uiIdx].error==nil then
+          uiReceived = uiReceived + 1
+        end
+      end
+    else
+      local tMessage = tConsumer:consume_view(100)
+      if tMessage~=nil then
+        if tMessage:error()==nil then
+          uiReceived = uiReceived + 1
+        end
+        tMessage:release()
+      end
+    end
+  end
+  local dSeconds = (kafka.monotonic_us() - dStart) / 1000000
+
+  tConsumer = nil
+  collectgarbage()
+
+  return uiReceived / dSeconds
+end
+
+
+-- Send single messages and wait for each one. This returns the sorted round
+-- trip times in microseconds.
+local function measureRoundTrips(strBrokers, tCluster)
+  local strRoundTripTopic = 'benchmark_round_trip'
+  tCluster:create_topic(strRoundTripTopic, 1, 1)
+
+  local tProducer = kafka.Producer(strBrokers, {
+    ['linger.ms'] = 0
+  })
+  local tTopic = tProducer:create_topic(strRoundTripTopic)
+  local tConsumer = kafka.Consumer(strBrokers, 'benchmark_round_trip', {
+    ['auto.offset.reset'] = 'earliest',
+    ['fetch.wait.max.ms'] = 1
+  })
+  tConsumer:subscribe({ strRoundTripTopic })
+
+  -- Wait until the consumer got its partition.
+  local dTimeout = kafka.monotonic_us() + uiTimeoutMs*1000
+  tTopic:send(0, 'warmup')
+  local tMessage
+  repeat
+    if kafka.monotonic_us()>dTimeout then
+      error('The round trip consumer did not get the warmup message.')
+    end
+    tProducer:poll(0)
+    tMessage = tConsumer:consume(100)
+  until tMessage~=nil and tMessage.error==nil
+
+  local adRoundTrips = {}
+  for uiCnt = 1, uiRoundTrips do
+    local strPayload = tostring(uiCnt)
+    local dStart = kafka.monotonic_us()
+    tTopic:send(0, strPayload)
+    repeat
+      if kafka.monotonic_us()>dTimeout then
+        error(string.format('Round trip %d timed out.', uiCnt))
+      end
+      tProducer:poll(0)
+      tMessage = tConsumer:consume(10)
+    until tMessage~=nil and tMessage.value==strPayload
+    adRoundTrips[uiCnt] = kafka.monotonic_us() - dStart
+  end
+  table.sort(adRoundTrips)
+
+  tConsumer = nil
+  tTopic = nil
+  tProducer = nil
+  collectgarbage()
+
+  return adRoundTrips
+end
+
+
+local function percentile(adSorted, dPercentile)
+  local uiIndex = math.max(1, math.ceil(#adSorted * dPercentile / 100))
+  return adSorted[uiIndex]
+end
+
+
+local tCluster = kafka.MockCluster(1)
+local strBrokers = tCluster:bootstrap_servers()
+tCluster:create_topic(strTopic, 4, 1)
+
+print(string.format('Filling the topic with %d messages of %d bytes...', uiMessages, uiPayloadSize))
+local dStart = kafka.monotonic_us()
+fillTopic(strBrokers)
+print(string.format('Filled in %.1f s.', (kafka.monotonic_us() - dStart) / 1000000))
+
+print(string.format('%-14s %12s %10s', 'mode', 'msgs/s', 'MB/s'))
+for _, strMode in ipairs({ 'consume', 'consume_batch', 'consume_view' }) do
+  local dRate = consumeAll(strBrokers, strMode)
+  print(string.format('%-14s %12.0f %10.2f', strMode, dRate, dRate * uiPayloadSize / 1048576))
+end
+
+local adRoundTrips = measureRoundTrips(strBrokers, tCluster)
+print(string.format(
+  'round trip (%d messages): p50 %.0f us, p99 %.0f us, max %.0f us',
+  #adRoundTrips,
+  percentile(adRoundTrips, 50),
+  percentile(adRoundTrips, 99),
+  adRoundTrips[#adRoundTrips]
+))
+
+tCluster = nil
+collectgarbage()
@@ -0,0 +1,145 @@
+-- Measure the producer throughput of the module against the mock cluster of
+-- librdkafka. No network and no broker are needed.
+--
+-- Usage: lua benchmark_producer.lua [messages per run]
+--
+-- Each run prints the codec, the payload size, the send mode, the messages
+-- per second, the MB per second, the p99 delivery latency and the resident
+-- set size of the process.
+local kafka = require 'kafka'
+
+local uiMessages = tonumber(arg and arg[1]) or 200000
+local atCodecs = { 'none', 'lz4', 'zstd' }
+local atPayloadSizes = { 64, 1024, 16384 }
+local atModes = { 'send', 'zero_copy', 'batch' }
+local uiBatchSize = 1000
+local uiFlushTimeoutMs = 60000
+
+
+-- Get the resident set size in KB. This works only on Linux.
+local function getRssKb()
+  local ulRss
+  local tFile = io.open('/proc/self/status', 'r')
+  if tFile~=nil then
+    for strLine in tFile:lines() do
+      local strRss = string.match(strLine, '^VmRSS:%s+(%d+)%s+kB')
+      if strRss~=nil then
+        ulRss = tonumber(strRss)
+        break
+      end
+    end
+    tFile:close()
+  end
+  return ulRss
+end
+
+
+local function sendSingle(tProducer, tTopic, strPayload)
+  for uiCnt = 1, uiMessages do
+    local tResult, strError = tTopic:send(kafka.PARTITION_UA, strPayload)
+    if tResult~=0 then
+      error(string.format('Failed to send: %s', strError))
+    end
+    -- Serve the delivery reports like a real application.
+    if (uiCnt % uiBatchSize)==0 then
+      tProducer:poll(0)
+    end
+  end
+end
+
+
+local function sendBatch(tProducer, tTopic, strPayload)
+  local atBatch = {}
+  local uiSent = 0
+  while uiSent<uiMessages do
+    local uiChunk = math.min(uiBatchSize, uiMessages-uiSent)
+    for uiCnt = 1, uiChunk do
+      atBatch[uiCnt] = strPayload
+    end
+    for uiCnt = uiChunk+1, #atBatch do
+      atBatch[uiCnt] = nil
+    end
+
+    -- All messages are equal. Rejected messages are simply sent again
+    -- with the next batch.
+    local uiAccepted = tTopic:send_batch(atBatch)
+    uiSent = uiSent + uiAccepted
+    if uiAccepted<uiChunk then
+      tProducer:poll(10)
+    else
+      tProducer:poll(0)
+    end
+  end
+end
+
+
+local strFeatures = kafka.builtin_features()
+local tCluster = kafka.MockCluster(1)
+local strBrokers = tCluster:bootstrap_servers()
+
+print(string.format('librdkafka features: %s', strFeatures))
+print(string.format('%d messages per run', uiMessages))
+print(string.format('%-6s %7s %-10s %12s %10s %10s %10s', 'codec', 'size', 'mode', 'msgs/s', 'MB/s', 'p99 us', 'RSS kB'))
+
+local uiRun = 0
+for _, strCodec in ipairs(atCodecs) do
+  for _, uiPayloadSize in ipairs(atPayloadSizes) do
+    for _, strMode in ipairs(atModes) do
+      uiRun = uiRun + 1
+      local strTopic = string.format('benchmark_producer_%d', uiRun)
+      tCluster:create_topic(strTopic, 4, 1)
+
+      local tProducer = kafka.Producer(strBrokers, {
+        ['compression.codec'] = strCodec,
+        ['linger.ms'] = 5,
+        ['queue.buffering.max.messages'] = 1000000,
+        ['queue.buffering.max.kbytes'] = 1048576
+      })
+      local tTopic = tProducer:create_topic(strTopic)
+      tTopic:set_send_timeout(1000)
+      if strMode=='zero_copy' then
+        tTopic:set_zero_copy(true)
+      end
+
+      -- Compressible, but not trivial data.
+      local strPayload = string.rep(string.format('%08x', uiRun), math.ceil(uiPayloadSize/8)):sub(1, uiPayloadSize)
+
+      local dStart = kafka.monotonic_us()
+      if strMode=='batch' then
+        sendBatch(tProducer, tTopic, strPayload)
+      else
+        sendSingle(tProducer, tTopic, strPayload)
+      end
+      local tResult, strError = tProducer:flush(uiFlushTimeoutMs)
+      if tResult~=0 then
+        error(string.format('Failed to flush: %s', strError))
+      end
+      tProducer:poll(0)
+      local dSeconds = (kafka.monotonic_us() - dStart) / 1000000
+
+      local tStats = tProducer:get_delivery_stats()
+      if tStats.delivered~=uiMessages or tStats.failed~=0 then
+        error(string.format('%d messages delivered, %d failed.', tStats.delivered, tStats.failed))
+      end
+      local tLatency = tTopic:get_latency()
+
+      print(string.format(
+        '%-6s %7d %-10s %12.0f %10.2f %10s %10s',
+        strCodec,
+        uiPayloadSize,
+        strMode,
+        uiMessages / dSeconds,
+        tStats.bytes / dSeconds / 1048576,
+        tostring(tLatency.p99),
+        tostring(getRssKb())
+      ))
+
+      tTopic = nil
+      tProducer = nil
+      collectgarbage()
+    end
+  end
+end
+
+tCluster = nil
+collectgarbage()
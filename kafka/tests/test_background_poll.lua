@@ -0,0 +1,88 @@
+-- Start and stop the background poll thread while messages are in flight.
+-- No delivery report may get lost, no matter if it is processed by the
+-- thread, by "poll_reports", by "stop_background_poll" or by "flush".
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'background_poll'
+local uiMessages = 2000
+local uiRingSize = 256
+local uiTimeoutMs = tHelper.uiTimeoutMs
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, 2)
+
+-- The linger time keeps the messages in flight when the thread is stopped.
+local tProducer = kafka.Producer(strBrokers, { ['linger.ms'] = 50 })
+local tTopic = tProducer:create_topic(strTopic)
+
+local function startBackgroundPoll()
+  tHelper.check('start the background poll', tProducer:start_background_poll(uiRingSize))
+end
+
+local function sendAll()
+  for uiCnt = 1, uiMessages do
+    tHelper.check('send', tTopic:send(kafka.PARTITION_UA, string.format('message %d', uiCnt)))
+  end
+end
+
+local function checkDelivered(strName, uiExpected)
+  local tStats = tProducer:get_delivery_stats()
+  if tStats.delivered~=uiExpected or tStats.failed~=0 then
+    error(string.format('%s: %d messages delivered, %d failed, expected %d.', strName, tStats.delivered, tStats.failed, uiExpected))
+  end
+end
+
+-- Stop the thread right after sending. The reports must arrive with a
+-- normal flush.
+startBackgroundPoll()
+sendAll()
+tProducer:stop_background_poll()
+tHelper.check('flush', tProducer:flush(uiTimeoutMs))
+checkDelivered('stop in flight', uiMessages)
+
+-- Collect the reports with "poll_reports" while the thread runs. The ring
+-- is smaller than the number of messages, so the thread has to wait for
+-- free space. Each sequence number must be reported once.
+startBackgroundPoll()
+sendAll()
+local atSeen = {}
+local uiReports = 0
+local dDeadline = tHelper.getDeadline()
+while uiReports<uiMessages do
+  if tHelper.isExpired(dDeadline) then
+    error(string.format('Only %d of %d reports received.', uiReports, uiMessages))
+  end
+  local atReports = tProducer:poll_reports(100)
+  for _, tReport in ipairs(atReports) do
+    if tReport.error~=0 then
+      error(string.format('Message %d failed: %s', tReport.sequence, tProducer:error2string(tReport.error)))
+    end
+    if atSeen[tReport.sequence]~=nil then
+      error(string.format('Message %d was reported twice.', tReport.sequence))
+    end
+    atSeen[tReport.sequence] = true
+    uiReports = uiReports + 1
+  end
+end
+checkDelivered('poll_reports', 2*uiMessages)
+
+-- Flush with the thread running, then stop it with nothing in flight.
+sendAll()
+tHelper.check('flush', tProducer:flush(uiTimeoutMs))
+tProducer:stop_background_poll()
+checkDelivered('flush in background mode', 3*uiMessages)
+
+-- Stopping twice is harmless.
+tProducer:stop_background_poll()
+
+-- Release the producer with the thread running and messages in flight.
+startBackgroundPoll()
+sendAll()
+tTopic = nil
+tProducer = nil
+collectgarbage()
+
+print('background poll: OK')
+
+tCluster = nil
+collectgarbage()
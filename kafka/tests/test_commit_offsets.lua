@@ -0,0 +1,91 @@
+-- Store and commit offsets with a consumer group on a mock cluster. A new
+-- consumer in the same group must continue after the committed offset.
+local tHelper = require 'test_helper'
+
+local strTopic = 'commit_offsets'
+local strGroup = 'test_commit_offsets'
+local uiMessages = 100
+local uiFirstCommit = 40
+local uiSecondCommit = 60
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, 1)
+
+-- Fill the topic. The value is the offset of the message.
+tHelper.produce(strBrokers, strTopic, { ['linger.ms'] = 5 }, uiMessages, function(uiCnt)
+  return 0, tostring(uiCnt-1)
+end)
+
+
+local function createConsumer()
+  return tHelper.subscribe(strBrokers, strGroup, { strTopic })
+end
+
+
+-- Wait for the next message and check its offset.
+local function consumeNext(tConsumer, ulExpectedOffset)
+  local dDeadline = tHelper.getDeadline()
+  local tMessage
+  repeat
+    if tHelper.isExpired(dDeadline) then
+      error(string.format('No message with the offset %d arrived.', ulExpectedOffset))
+    end
+    tMessage = tConsumer:consume(100)
+  until tMessage~=nil and tMessage.error==nil
+  if tMessage.offset~=ulExpectedOffset or tMessage.value~=tostring(ulExpectedOffset) then
+    error(string.format('Expected the offset %d, got %d with the value "%s".', ulExpectedOffset, tMessage.offset, tostring(tMessage.value)))
+  end
+  return tMessage
+end
+
+
+-- Consume the first messages, store their offsets and commit them.
+local tConsumer = createConsumer()
+for ulOffset = 0, uiFirstCommit-1 do
+  local tMessage = consumeNext(tConsumer, ulOffset)
+  tHelper.check(string.format('store the offset %d', ulOffset), tConsumer:store_offset(tMessage.topic, tMessage.partition, tMessage.offset))
+end
+tHelper.check('commit', tConsumer:commit_async())
+
+-- Wait for the result of the commit. The committed offset is the next
+-- message to read.
+local atResults = {}
+local dDeadline = tHelper.getDeadline()
+while #atResults==0 do
+  if tHelper.isExpired(dDeadline) then
+    error('The commit did not finish.')
+  end
+  atResults = tConsumer:poll(100)
+end
+if #atResults~=1 then
+  error(string.format('The commit has %d results, expected 1.', #atResults))
+end
+local tCommit = atResults[1]
+if tCommit.error~=nil then
+  error(string.format('The commit failed: %s', tConsumer:error2string(tCommit.error)))
+end
+if tCommit.topic~=strTopic or tCommit.partition~=0 or tCommit.offset~=uiFirstCommit then
+  error(string.format('Committed %s/%d at %d, expected %s/0 at %d.', tostring(tCommit.topic), tCommit.partition, tCommit.offset, strTopic, uiFirstCommit))
+end
+
+-- Store more offsets without a commit. The consumer commits them when it
+-- is released.
+for ulOffset = uiFirstCommit, uiSecondCommit-1 do
+  local tMessage = consumeNext(tConsumer, ulOffset)
+  tHelper.check(string.format('store the offset %d', ulOffset), tConsumer:store_offset(tMessage.topic, tMessage.partition, tMessage.offset))
+end
+tConsumer = nil
+collectgarbage()
+
+-- Restart the consumer. It must continue after the last stored offset and
+-- read all remaining messages.
+tConsumer = createConsumer()
+for ulOffset = uiSecondCommit, uiMessages-1 do
+  consumeNext(tConsumer, ulOffset)
+end
+tConsumer = nil
+collectgarbage()
+
+print('commit offsets: OK')
+
+tCluster = nil
+collectgarbage()
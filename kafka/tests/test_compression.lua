@@ -0,0 +1,55 @@
+-- Send messages with all compression codecs through a mock cluster and read
+-- them back. This proves that the codecs are compiled into librdkafka and
+-- work end to end.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local atCodecs = { 'gzip', 'lz4', 'zstd', 'snappy' }
+local uiMessages = 100
+
+-- All codecs must be compiled in.
+local strFeatures = kafka.builtin_features()
+print(string.format('librdkafka features: %s', strFeatures))
+for _, strCodec in ipairs(atCodecs) do
+  if string.find(','..strFeatures..',', ','..strCodec..',', 1, true)==nil then
+    error(string.format('The codec "%s" is not compiled into librdkafka.', strCodec))
+  end
+end
+
+local tCluster = kafka.MockCluster(1)
+local strBrokers = tCluster:bootstrap_servers()
+
+for _, strCodec in ipairs(atCodecs) do
+  local strTopic = 'compression_' .. strCodec
+  tHelper.createTopic(tCluster, strTopic, 1)
+
+  -- Produce compressible messages. Include 0 bytes to check binary data.
+  local atSent = {}
+  for uiCnt = 1, uiMessages do
+    atSent[uiCnt] = string.format('%s message %d\0', strCodec, uiCnt) .. string.rep('x', 1000)
+  end
+  local tStats = tHelper.produce(strBrokers, strTopic, {
+    ['compression.codec'] = strCodec,
+    ['linger.ms'] = 10
+  }, uiMessages, function(uiCnt)
+    return 0, atSent[uiCnt]
+  end)
+  if tStats.delivered~=uiMessages or tStats.failed~=0 then
+    error(string.format('%s: %d messages delivered, %d failed.', strCodec, tStats.delivered, tStats.failed))
+  end
+
+  -- Read all messages back.
+  local tConsumer = tHelper.subscribe(strBrokers, 'test_' .. strCodec, { strTopic })
+  tHelper.consume(strCodec, tConsumer, uiMessages, function(tMessage, uiReceived)
+    if tMessage.value~=atSent[uiReceived] then
+      error(string.format('%s: message %d differs.', strCodec, uiReceived))
+    end
+  end)
+  tConsumer = nil
+  collectgarbage()
+
+  print(string.format('%s: OK', strCodec))
+end
+
+tCluster = nil
+collectgarbage()
@@ -0,0 +1,134 @@
+-- Read messages from a mock cluster with "consume", "consume_batch" and
+-- "consume_view". Each mode must get every message once with the correct
+-- key and value. The views also check the message headers.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'consumer'
+local uiPartitions = 2
+local uiMessages = 500
+local uiBatchSize = 64
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, uiPartitions)
+
+-- Fill the topic. The key is the message number. Each message has two
+-- headers, one of them with binary data.
+tHelper.produce(strBrokers, strTopic, { ['linger.ms'] = 5 }, uiMessages, function(uiCnt)
+  local atHeaders = {
+    ['trace'] = string.format('trace %d', uiCnt),
+    ['binary'] = string.char(0, uiCnt % 256, 0)
+  }
+  return kafka.PARTITION_UA, string.format('message %d', uiCnt), tostring(uiCnt), atHeaders
+end)
+
+
+-- Check one message and count it.
+local function checkMessage(strMode, atSeen, strTopicName, strKey, strValue)
+  if strTopicName~=strTopic then
+    error(string.format('%s: got a message from topic "%s".', strMode, tostring(strTopicName)))
+  end
+  local uiKey = tonumber(strKey)
+  if uiKey==nil or strValue~=string.format('message %d', uiKey) then
+    error(string.format('%s: the key "%s" does not match the value "%s".', strMode, tostring(strKey), tostring(strValue)))
+  end
+  if atSeen[uiKey]~=nil then
+    error(string.format('%s: message %d was received twice.', strMode, uiKey))
+  end
+  atSeen[uiKey] = true
+end
+
+
+-- Check the headers of a message view.
+local function checkHeaders(strMode, uiKey, tMessage)
+  local strTrace = string.format('trace %d', uiKey)
+  local strBinary = string.char(0, uiKey % 256, 0)
+  if tMessage:header('trace')~=strTrace then
+    error(string.format('%s: message %d has the trace header "%s".', strMode, uiKey, tostring(tMessage:header('trace'))))
+  end
+  if tMessage:header('missing')~=nil then
+    error(string.format('%s: message %d has an unexpected header.', strMode, uiKey))
+  end
+  local atHeaders = tMessage:headers()
+  if atHeaders.trace~=strTrace or atHeaders.binary~=strBinary then
+    error(string.format('%s: message %d has wrong headers.', strMode, uiKey))
+  end
+end
+
+
+local function consumeAll(strMode)
+  local tConsumer
+  if strMode=='consume_view' then
+    -- Use a fixed assignment instead of the group.
+    tConsumer = kafka.Consumer(strBrokers, 'test_' .. strMode, {
+      ['auto.offset.reset'] = 'earliest'
+    })
+    local atPartitions = {}
+    for uiPartition = 0, uiPartitions-1 do
+      table.insert(atPartitions, { topic=strTopic, partition=uiPartition, offset=0 })
+    end
+    tHelper.check('assign the partitions', tConsumer:assign(atPartitions))
+  else
+    tConsumer = tHelper.subscribe(strBrokers, 'test_' .. strMode, { strTopic })
+  end
+
+  local atSeen = {}
+  local atMessages = {}
+  local uiReceived = 0
+  local dDeadline = tHelper.getDeadline()
+  while uiReceived<uiMessages do
+    if tHelper.isExpired(dDeadline) then
+      error(string.format('%s: only %d of %d messages received.', strMode, uiReceived, uiMessages))
+    end
+
+    if strMode=='consume' then
+      local tMessage = tConsumer:consume(100)
+      if tMessage~=nil and tMessage.error==nil then
+        checkMessage(strMode, atSeen, tMessage.topic, tMessage.key, tMessage.value)
+        uiReceived = uiReceived + 1
+      end
+    elseif strMode=='consume_batch' then
+      local uiCnt = tConsumer:consume_batch(uiBatchSize, 100, atMessages)
+      if uiCnt>uiBatchSize then
+        error(string.format('%s: got %d messages, the limit is %d.', strMode, uiCnt, uiBatchSize))
+      end
+      for uiIdx = 1, uiCnt do
+        local tMessage = atMessages[uiIdx]
+        if tMessage.error==nil then
+          checkMessage(strMode, atSeen, tMessage.topic, tMessage.key, tMessage.value)
+          uiReceived = uiReceived + 1
+        end
+      end
+      -- All entries after the last message must be cleared.
+      if atMessages[uiCnt+1]~=nil then
+        error(string.format('%s: entry %d was not cleared.', strMode, uiCnt+1))
+      end
+    else
+      local tMessage = tConsumer:consume_view(100)
+      if tMessage~=nil then
+        if tMessage:error()==nil then
+          local strKey = tMessage:key()
+          checkMessage(strMode, atSeen, tMessage:topic(), strKey, tMessage:value())
+          checkHeaders(strMode, tonumber(strKey), tMessage)
+          uiReceived = uiReceived + 1
+        end
+        tMessage:release()
+        if tMessage:value()~=nil then
+          error(string.format('%s: the value is still there after release.', strMode))
+        end
+      end
+    end
+  end
+
+  tConsumer = nil
+  collectgarbage()
+end
+
+
+for _, strMode in ipairs({ 'consume', 'consume_batch', 'consume_view' }) do
+  consumeAll(strMode)
+end
+
+print('consumer: OK')
+
+tCluster = nil
+collectgarbage()
@@ -0,0 +1,100 @@
+-- Common setup of the tests. The tests run in this folder, so they can load
+-- this file with "require 'test_helper'".
+local kafka = require 'kafka'
+
+local tHelper = {}
+
+-- All tests wait up to 10 seconds for the mock cluster.
+tHelper.uiTimeoutMs = 10000
+
+
+-- Raise an error if a call did not return 0.
+function tHelper.check(strAction, tResult, strError)
+  if tResult~=0 then
+    error(string.format('Failed to %s: %s', strAction, tostring(strError)))
+  end
+end
+
+
+-- Get a deadline in microseconds for "isExpired". The default is the
+-- timeout of all tests.
+function tHelper.getDeadline(uiTimeoutMs)
+  return kafka.monotonic_us() + (uiTimeoutMs or tHelper.uiTimeoutMs)*1000
+end
+
+
+function tHelper.isExpired(dDeadline)
+  return kafka.monotonic_us()>dDeadline
+end
+
+
+-- Create a mock cluster and a topic in it. This returns the cluster and
+-- the bootstrap servers.
+function tHelper.createCluster(strTopic, uiPartitions, uiBrokers)
+  local tCluster = kafka.MockCluster(uiBrokers or 1)
+  tHelper.createTopic(tCluster, strTopic, uiPartitions)
+  return tCluster, tCluster:bootstrap_servers()
+end
+
+
+function tHelper.createTopic(tCluster, strTopic, uiPartitions)
+  local tResult, strError = tCluster:create_topic(strTopic, uiPartitions or 1, 1)
+  if tResult~=0 then
+    error(string.format('Failed to create the topic "%s": %s', strTopic, strError))
+  end
+end
+
+
+-- Send messages with a new producer and flush it. The function fnMessage
+-- gets the message number and returns the partition, the value, the key
+-- and the headers of the message.
+function tHelper.produce(strBrokers, strTopic, atConfig, uiMessages, fnMessage)
+  local tProducer = kafka.Producer(strBrokers, atConfig)
+  local tTopic = tProducer:create_topic(strTopic)
+  for uiCnt = 1, uiMessages do
+    tHelper.check('send', tTopic:send(fnMessage(uiCnt)))
+  end
+  tHelper.check('flush', tProducer:flush(tHelper.uiTimeoutMs))
+  local tStats = tProducer:get_delivery_stats()
+  tTopic = nil
+  tProducer = nil
+  collectgarbage()
+  return tStats
+end
+
+
+-- Create a consumer in the group strGroup which starts at the earliest
+-- offset and subscribe to the topics.
+function tHelper.subscribe(strBrokers, strGroup, atTopics, atConfig)
+  local atAllConfig = { ['auto.offset.reset'] = 'earliest' }
+  for strKey, tValue in pairs(atConfig or {}) do
+    atAllConfig[strKey] = tValue
+  end
+  local tConsumer = kafka.Consumer(strBrokers, strGroup, atAllConfig)
+  local tResult, strError = tConsumer:subscribe(atTopics)
+  if tResult~=0 then
+    error(string.format('Failed to subscribe to "%s": %s', table.concat(atTopics, ', '), strError))
+  end
+  return tConsumer
+end
+
+
+-- Read uiMessages messages with "consume". The function fnMessage gets
+-- each message without an error and its number.
+function tHelper.consume(strName, tConsumer, uiMessages, fnMessage)
+  local uiReceived = 0
+  local dDeadline = tHelper.getDeadline()
+  while uiReceived<uiMessages do
+    if tHelper.isExpired(dDeadline) then
+      error(string.format('%s: only %d of %d messages received.', strName, uiReceived, uiMessages))
+    end
+    local tMessage = tConsumer:consume(100)
+    if tMessage~=nil and tMessage.error==nil then
+      uiReceived = uiReceived + 1
+      fnMessage(tMessage, uiReceived)
+    end
+  end
+end
+
+
+return tHelper
@@ -0,0 +1,55 @@
+-- Prefetch the metadata of a topic in a mock cluster and check the
+-- partitions and their leaders.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'metadata'
+local uiPartitions = 4
+local uiBrokers = 3
+local uiTimeoutMs = tHelper.uiTimeoutMs
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, uiPartitions, uiBrokers)
+local strError
+
+local tProducer = kafka.Producer(strBrokers)
+tHelper.check('prefetch the metadata', tProducer:prefetch_metadata({ strTopic }, uiTimeoutMs))
+
+local tMetadata
+tMetadata, strError = tProducer:get_metadata(uiTimeoutMs)
+if tMetadata==nil then
+  error(string.format('Failed to get the metadata: %s', strError))
+end
+
+local tTopic = tMetadata.topics[strTopic]
+if tTopic==nil then
+  error(string.format('The topic "%s" is missing in the metadata.', strTopic))
+end
+if tTopic.error~=nil then
+  error(string.format('The topic "%s" has the error %d.', strTopic, tTopic.error))
+end
+if tTopic.partition_count~=uiPartitions then
+  error(string.format('The topic has %d partitions, expected %d.', tTopic.partition_count, uiPartitions))
+end
+for uiPartition = 0, uiPartitions-1 do
+  local tPartition = tTopic.partitions[uiPartition]
+  if tPartition==nil then
+    error(string.format('Partition %d is missing.', uiPartition))
+  end
+  if tMetadata.brokers[tPartition.leader]==nil then
+    error(string.format('The leader %d of partition %d is not in the broker list.', tPartition.leader, uiPartition))
+  end
+  print(string.format('partition %d: leader %d', uiPartition, tPartition.leader))
+end
+
+-- The first message must not wait for the metadata.
+local tTopicHandle = tProducer:create_topic(strTopic)
+tHelper.check('send', tTopicHandle:send(kafka.PARTITION_UA, 'first message'))
+tHelper.check('flush', tProducer:flush(uiTimeoutMs))
+
+print('metadata: OK')
+
+tTopicHandle = nil
+tProducer = nil
+collectgarbage()
+tCluster = nil
+collectgarbage()
@@ -0,0 +1,104 @@
+-- Send messages through a sharded producer to a mock cluster. Messages with
+-- the same key must arrive in order, no matter which shard sent them.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'sharded'
+local uiShards = 4
+local uiKeys = 8
+local uiMessagesPerKey = 50
+local uiTimeoutMs = tHelper.uiTimeoutMs
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, 4)
+
+local tProducer = kafka.ShardedProducer(strBrokers, uiShards, { ['linger.ms'] = 5 })
+if tProducer:shards()~=uiShards then
+  error(string.format('The producer has %d shards, expected %d.', tProducer:shards(), uiShards))
+end
+local tTopic = tProducer:create_topic(strTopic)
+
+-- Each shard counts its own sequence numbers. The "shard" field of the
+-- reports tells them apart.
+local atReported = {}
+local uiReported = 0
+tProducer:set_delivery_callback(function(atReports)
+  for _, tReport in ipairs(atReports) do
+    if tReport.shard==nil or tReport.shard<1 or tReport.shard>uiShards then
+      error(string.format('The report has the invalid shard %s.', tostring(tReport.shard)))
+    end
+    local strId = string.format('%d/%d', tReport.shard, tReport.sequence)
+    if atReported[strId]~=nil then
+      error(string.format('Message %s was reported twice.', strId))
+    end
+    atReported[strId] = true
+    uiReported = uiReported + 1
+  end
+end)
+
+-- Send one half of the messages one by one and the other half in batches.
+local uiExpected = 0
+for uiCnt = 1, uiMessagesPerKey/2 do
+  for uiKey = 1, uiKeys do
+    tHelper.check('send', tTopic:send(kafka.PARTITION_UA, tostring(uiCnt), 'key' .. uiKey))
+    uiExpected = uiExpected + 1
+  end
+end
+for uiCnt = uiMessagesPerKey/2+1, uiMessagesPerKey do
+  local atBatch = {}
+  for uiKey = 1, uiKeys do
+    table.insert(atBatch, { value=tostring(uiCnt), key='key' .. uiKey })
+  end
+  local uiAccepted, atErrors = tTopic:send_batch(atBatch)
+  if uiAccepted~=#atBatch then
+    for uiIndex, tError in pairs(atErrors) do
+      print(string.format('Message %d failed: %s', uiIndex, tProducer:error2string(tError)))
+    end
+    error('Failed to send the batch.')
+  end
+  uiExpected = uiExpected + uiAccepted
+end
+
+-- Messages without a key are spread over the shards.
+for uiCnt = 1, uiShards do
+  tHelper.check('send', tTopic:send(kafka.PARTITION_UA, 'no key'))
+  uiExpected = uiExpected + 1
+end
+
+tHelper.check('flush', tProducer:flush(uiTimeoutMs))
+tProducer:poll(0)
+if uiReported~=uiExpected then
+  error(string.format('The callback got %d reports, expected %d.', uiReported, uiExpected))
+end
+local tStats = tProducer:get_delivery_stats()
+if tStats.delivered~=uiExpected or tStats.failed~=0 then
+  error(string.format('%d messages delivered, %d failed, expected %d.', tStats.delivered, tStats.failed, uiExpected))
+end
+tStats = tTopic:get_delivery_stats()
+if tStats.delivered~=uiExpected then
+  error(string.format('The topic delivered %d messages, expected %d.', tStats.delivered, uiExpected))
+end
+
+tTopic = nil
+tProducer = nil
+collectgarbage()
+
+-- Read all messages back and check the order for each key.
+local tConsumer = tHelper.subscribe(strBrokers, 'test_sharded', { strTopic })
+local atLastValue = {}
+tHelper.consume('sharded producer', tConsumer, uiExpected, function(tMessage)
+  if tMessage.key~=nil then
+    local uiValue = tonumber(tMessage.value)
+    local uiLast = atLastValue[tMessage.key] or 0
+    if uiValue~=uiLast+1 then
+      error(string.format('Key %s: got %d after %d.', tMessage.key, uiValue, uiLast))
+    end
+    atLastValue[tMessage.key] = uiValue
+  end
+end)
+tConsumer = nil
+collectgarbage()
+
+print('sharded producer: OK')
+
+tCluster = nil
+collectgarbage()
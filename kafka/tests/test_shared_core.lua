@@ -0,0 +1,74 @@
+-- Create several shared producers with the same config. They must use one
+-- librdkafka handle, which is visible in the common delivery counters.
+-- A producer with a different config or without the shared flag gets its
+-- own handle.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'shared_core'
+local uiMessages = 10
+local uiTimeoutMs = tHelper.uiTimeoutMs
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, 1)
+
+-- The order of the config entries does not matter.
+local tProducer1 = kafka.Producer(strBrokers, { ['linger.ms'] = 5, ['acks'] = 'all' }, true)
+local tProducer2 = kafka.Producer(strBrokers, { ['acks'] = 'all', ['linger.ms'] = 5 }, true)
+local tProducerOther = kafka.Producer(strBrokers, { ['linger.ms'] = 6, ['acks'] = 'all' }, true)
+local tProducerPrivate = kafka.Producer(strBrokers, { ['linger.ms'] = 5, ['acks'] = 'all' })
+
+local function sendAll(tProducer)
+  local tTopic = tProducer:create_topic(strTopic)
+  for uiCnt = 1, uiMessages do
+    tHelper.check('send', tTopic:send(0, string.format('message %d', uiCnt)))
+  end
+  tHelper.check('flush', tProducer:flush(uiTimeoutMs))
+end
+
+local function checkDelivered(strName, tProducer, uiExpected)
+  local tStats = tProducer:get_delivery_stats()
+  if tStats.delivered~=uiExpected then
+    error(string.format('%s: %d messages delivered, expected %d.', strName, tStats.delivered, uiExpected))
+  end
+end
+
+sendAll(tProducer1)
+sendAll(tProducer2)
+sendAll(tProducerOther)
+sendAll(tProducerPrivate)
+
+checkDelivered('producer 1', tProducer1, 2*uiMessages)
+checkDelivered('producer 2', tProducer2, 2*uiMessages)
+checkDelivered('other config', tProducerOther, uiMessages)
+checkDelivered('private', tProducerPrivate, uiMessages)
+
+-- The handle must survive the first producer.
+tProducer1 = nil
+collectgarbage()
+sendAll(tProducer2)
+checkDelivered('producer 2 alone', tProducer2, 3*uiMessages)
+
+-- A new shared producer after all others are gone gets a new handle.
+tProducer2 = nil
+collectgarbage()
+local tProducer3 = kafka.Producer(strBrokers, { ['linger.ms'] = 5, ['acks'] = 'all' }, true)
+checkDelivered('new producer', tProducer3, 0)
+
+-- Shared producers without a config pass nil for the table.
+local tProducerNoConfig1 = kafka.Producer(strBrokers, nil, true)
+local tProducerNoConfig2 = kafka.Producer(strBrokers, nil, true)
+sendAll(tProducerNoConfig1)
+checkDelivered('no config 1', tProducerNoConfig1, uiMessages)
+checkDelivered('no config 2', tProducerNoConfig2, uiMessages)
+checkDelivered('producer 3 next to no config', tProducer3, 0)
+tProducerNoConfig1 = nil
+tProducerNoConfig2 = nil
+
+print('shared core: OK')
+
+tProducer3 = nil
+tProducerOther = nil
+tProducerPrivate = nil
+collectgarbage()
+tCluster = nil
+collectgarbage()
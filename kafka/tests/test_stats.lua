@@ -0,0 +1,78 @@
+-- Collect the librdkafka statistics of a producer on a mock cluster. The
+-- summary of "get_stats" must have the counters of the sent messages, the
+-- brokers and the partitions of the topic.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'stats'
+local uiPartitions = 2
+local uiMessages = 100
+local uiTimeoutMs = tHelper.uiTimeoutMs
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, uiPartitions)
+
+local tProducer = kafka.Producer(strBrokers, {
+  ['linger.ms'] = 5,
+  ['statistics.interval.ms'] = 100
+})
+local tTopic = tProducer:create_topic(strTopic)
+
+for uiCnt = 1, uiMessages do
+  tHelper.check('send', tTopic:send(kafka.PARTITION_UA, string.format('message %d', uiCnt)))
+end
+tHelper.check('flush', tProducer:flush(uiTimeoutMs))
+
+-- Wait for statistics which include all sent messages.
+local tStats
+local dDeadline = tHelper.getDeadline()
+repeat
+  if tHelper.isExpired(dDeadline) then
+    error('No statistics with all messages arrived.')
+  end
+  tProducer:poll(100)
+  tStats = tProducer:get_stats()
+until tStats~=nil and type(tStats.txmsgs)=='number' and tStats.txmsgs>=uiMessages
+
+for _, strField in ipairs({ 'ts', 'msg_cnt', 'msg_size', 'txmsgs', 'txbytes', 'rxmsgs', 'rxbytes' }) do
+  if type(tStats[strField])~='number' then
+    error(string.format('The field "%s" is missing in the statistics.', strField))
+  end
+end
+if tStats.msg_cnt~=0 then
+  error(string.format('%d messages are still in the queue after the flush.', tStats.msg_cnt))
+end
+
+if type(tStats.brokers)~='table' or next(tStats.brokers)==nil then
+  error('The statistics have no brokers.')
+end
+for strName, tBroker in pairs(tStats.brokers) do
+  if type(tBroker.outbuf_cnt)~='number' or type(tBroker.waitresp_cnt)~='number' then
+    error(string.format('The broker "%s" has no queue counters.', strName))
+  end
+end
+
+local tTopicStats = tStats.topics[strTopic]
+if tTopicStats==nil then
+  error(string.format('The statistics have no topic "%s".', strTopic))
+end
+for uiPartition = 0, uiPartitions-1 do
+  local tPartition = tTopicStats.partitions[uiPartition]
+  if tPartition==nil or type(tPartition.msgq_cnt)~='number' or type(tPartition.xmit_msgq_cnt)~='number' then
+    error(string.format('The statistics have no partition %d.', uiPartition))
+  end
+end
+
+-- The JSON document is available too.
+local strJson = tProducer:get_stats_json()
+if type(strJson)~='string' or string.sub(strJson, 1, 1)~='{' then
+  error('The statistics are no JSON document.')
+end
+
+tTopic = nil
+tProducer = nil
+collectgarbage()
+
+print('stats: OK')
+
+tCluster = nil
+collectgarbage()
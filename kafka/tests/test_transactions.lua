@@ -0,0 +1,103 @@
+-- Send messages in committed and aborted transactions through a mock
+-- cluster. A consumer with "read_committed" must only see the messages of
+-- the committed transactions.
+local kafka = require 'kafka'
+local tHelper = require 'test_helper'
+
+local strTopic = 'transactions'
+local uiMessages = 10
+local uiTimeoutMs = tHelper.uiTimeoutMs
+
+local tCluster, strBrokers = tHelper.createCluster(strTopic, 1)
+
+-- Keep up to 5 requests in flight. The idempotence keeps the order.
+local tProducer = kafka.Producer(strBrokers, {
+  ['transactional.id'] = 'test_transactions',
+  ['enable.idempotence'] = 'true',
+  ['max.in.flight.requests.per.connection'] = 5,
+  ['linger.ms'] = 5
+})
+local tTopic = tProducer:create_topic(strTopic)
+
+local function check(strAction, tResult, strError)
+  if tResult~=0 then
+    local tDetails = tProducer:get_transaction_error()
+    if tDetails~=nil then
+      strError = tDetails.message
+    end
+    error(string.format('Failed to %s: %s', strAction, strError))
+  end
+end
+
+local function sendTransaction(strPrefix, fCommit)
+  check('begin the transaction', tProducer:begin_transaction())
+  for uiCnt = 1, uiMessages do
+    check('send', tTopic:send(0, string.format('%s %d', strPrefix, uiCnt)))
+  end
+  if fCommit==true then
+    check('commit the transaction', tProducer:commit_transaction(uiTimeoutMs))
+  else
+    check('abort the transaction', tProducer:abort_transaction(uiTimeoutMs))
+  end
+end
+
+check('init the transactions', tProducer:init_transactions(uiTimeoutMs))
+sendTransaction('first', true)
+sendTransaction('aborted', false)
+
+-- Commit and abort with the background poll. The flush in the transaction
+-- calls must not process reports next to the background thread.
+check('start the background poll', tProducer:start_background_poll(256))
+sendTransaction('second', true)
+sendTransaction('aborted in background', false)
+sendTransaction('third', true)
+
+-- The background poll must still run after the transactions.
+if tProducer:start_background_poll(256)==0 then
+  error('The background poll was not running after the transactions.')
+end
+tProducer:stop_background_poll()
+tProducer:poll(0)
+
+local tStats = tProducer:get_delivery_stats()
+if tStats.delivered+tStats.failed~=5*uiMessages or tStats.delivered<3*uiMessages then
+  error(string.format('%d messages delivered and %d failed, expected %d in total.', tStats.delivered, tStats.failed, 5*uiMessages))
+end
+
+local tFatalError, strFatalReason = tProducer:get_fatal_error()
+if tFatalError~=nil then
+  error(string.format('The producer has a fatal error %d: %s', tFatalError, strFatalReason))
+end
+
+tTopic = nil
+tProducer = nil
+collectgarbage()
+
+-- Read the committed messages back. The aborted messages are in the log
+-- before the second and the third transaction, so they would show up
+-- before their end.
+local tConsumer = tHelper.subscribe(strBrokers, 'test_transactions', { strTopic }, {
+  ['isolation.level'] = 'read_committed'
+})
+local atExpected = {}
+for uiCnt = 1, uiMessages do
+  table.insert(atExpected, string.format('first %d', uiCnt))
+end
+for uiCnt = 1, uiMessages do
+  table.insert(atExpected, string.format('second %d', uiCnt))
+end
+for uiCnt = 1, uiMessages do
+  table.insert(atExpected, string.format('third %d', uiCnt))
+end
+tHelper.consume('read_committed', tConsumer, #atExpected, function(tMessage, uiReceived)
+  if tMessage.value~=atExpected[uiReceived] then
+    error(string.format('Message %d is "%s", expected "%s".', uiReceived, tMessage.value, atExpected[uiReceived]))
+  end
+end)
+tConsumer = nil
+collectgarbage()
+
+print('transactions: OK')
+
+tCluster = nil
+collectgarbage()
@@ -3,6 +3,17 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#       define WIN32_LEAN_AND_MEAN
+#       include <windows.h>
+#else
+#       include <fcntl.h>
+#       include <time.h>
+#       include <unistd.h>
+#endif
 
 
 const char* version(void)
@@ -12,6 +23,35 @@ const char* version(void)
 
 
 
+/* Return the list of features which are compiled into librdkafka. This is a
+ * comma separated string like "gzip,snappy,ssl,lz4,zstd".
+ */
+const char* builtin_features(void)
+{
+	static char acFeatures[512];
+	rd_kafka_conf_t *ptConf;
+	size_t sizFeatures;
+	rd_kafka_conf_res_t tConfRes;
+
+
+	acFeatures[0] = 0;
+	ptConf = rd_kafka_conf_new();
+	if( ptConf!=NULL )
+	{
+		sizFeatures = sizeof(acFeatures);
+		tConfRes = rd_kafka_conf_get(ptConf, "builtin.features", acFeatures, &sizFeatures);
+		if( tConfRes!=RD_KAFKA_CONF_OK )
+		{
+			acFeatures[0] = 0;
+		}
+		rd_kafka_conf_destroy(ptConf);
+	}
+
+	return acFeatures;
+}
+
+
+
 void kafka_initialize_error_codes(lua_State *ptLuaState)
 {
 	int iTop;
@@ -58,639 +98,6041 @@ void kafka_initialize_error_codes(lua_State *ptLuaState)
 }
 
 
-/*--------------------------------------------------------------------------*/
-
-RdKafkaCore::RdKafkaCore(void)
- : m_uiReferenceCounter(0)
- , m_ptRk(NULL)
- , m_uiFailures(0)
-{
-}
-
-
-
-RdKafkaCore::~RdKafkaCore(void)
+/* Create a list of message headers from a LUA table with the header names
+ * as keys and the values as strings. The names and values are read directly
+ * from the LUA strings, rd_kafka_header_add copies them once.
+ */
+static rd_kafka_resp_err_t kafka_create_headers(lua_State *ptLuaState, int iTableIndex, rd_kafka_headers_t **pptHeaders)
 {
 	rd_kafka_resp_err_t tResult;
-	int iMessages;
+	rd_kafka_headers_t *ptHeaders;
+	const char *pcName;
+	size_t sizName;
+	const char *pcValue;
+	size_t sizValue;
+	int iValueType;
 
 
-	if( m_ptRk!=NULL )
+	tResult = RD_KAFKA_RESP_ERR_NO_ERROR;
+	ptHeaders = rd_kafka_headers_new(8);
+
+	lua_pushnil(ptLuaState);
+	while( lua_next(ptLuaState, iTableIndex)!=0 )
 	{
-		/* Try to flush any waiting messages.
-		 * Wait for a maximum of 2 seconds.
+		/* Do not use lua_tolstring on a number key, this would confuse
+		 * lua_next.
 		 */
-		tResult = rd_kafka_flush(m_ptRk, 2000);
+		iValueType = lua_type(ptLuaState, -1);
+		if( lua_type(ptLuaState, -2)!=LUA_TSTRING || (iValueType!=LUA_TSTRING && iValueType!=LUA_TNUMBER) )
+		{
+			lua_pop(ptLuaState, 2);
+			tResult = RD_KAFKA_RESP_ERR__INVALID_ARG;
+			break;
+		}
+
+		pcName = lua_tolstring(ptLuaState, -2, &sizName);
+		pcValue = lua_tolstring(ptLuaState, -1, &sizValue);
+		tResult = rd_kafka_header_add(ptHeaders, pcName, (ssize_t)sizName, pcValue, (ssize_t)sizValue);
 		if( tResult!=RD_KAFKA_RESP_ERR_NO_ERROR )
 		{
-			/* Show an error. */
-			iMessages = rd_kafka_outq_len(m_ptRk);
-			fprintf(stderr, "RdKafkaCore(%p): failed to flush, %d messages left in the queue: %s\n", this, iMessages, rd_kafka_err2str(tResult));
+			lua_pop(ptLuaState, 2);
+			break;
 		}
 
-		rd_kafka_destroy(m_ptRk);
-		rd_kafka_wait_destroyed(1000);
-		m_ptRk = NULL;
+		lua_pop(ptLuaState, 1);
 	}
-}
 
+	if( tResult!=RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		rd_kafka_headers_destroy(ptHeaders);
+		ptHeaders = NULL;
+	}
+	*pptHeaders = ptHeaders;
 
+	return tResult;
+}
 
-/* Set the client software name and version in a configuration.
- * Recommended here: https://github.com/edenhill/librdkafka/wiki/Language-bindings-development#reporting-client-software-name-and-version-to-broker
- * Both operations are not fatal as they are only informational.
- */
-void RdKafkaCore::setClientId(rd_kafka_conf_t *ptConf)
+
+static void kafka_push_delivery_statistics(lua_State *ptLuaState, const KAFKA_DELIVERY_STATISTICS_T *ptStatistics)
 {
-	rd_kafka_conf_res_t tCfgRes;
-	char acVersion[256];
-	char acError[512];
+	lua_createtable(ptLuaState, 0, 4);
+
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptLuaState, (lua_Integer)ptStatistics->ullDelivered);
+#else
+	lua_pushnumber(ptLuaState, (lua_Number)ptStatistics->ullDelivered);
+#endif
+	lua_setfield(ptLuaState, -2, "delivered");
 
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptLuaState, (lua_Integer)ptStatistics->ullFailed);
+#else
+	lua_pushnumber(ptLuaState, (lua_Number)ptStatistics->ullFailed);
+#endif
+	lua_setfield(ptLuaState, -2, "failed");
 
-	tCfgRes = rd_kafka_conf_set(ptConf, "client.software.name", "org.muhkuh.lua-kafka", acError, sizeof(acError));
-	if(tCfgRes)
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptLuaState, (lua_Integer)ptStatistics->ullBytes);
+#else
+	lua_pushnumber(ptLuaState, (lua_Number)ptStatistics->ullBytes);
+#endif
+	lua_setfield(ptLuaState, -2, "bytes");
+
+	/* The sequence number is nil if no message was acked yet. */
+	if( ptStatistics->fHasAcked==true )
 	{
-		fprintf(stderr, "Failed to set 'client.software.name': %s\n", acError);
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(ptLuaState, (lua_Integer)ptStatistics->uiLastAckedSequenceNr);
+#else
+		lua_pushnumber(ptLuaState, (lua_Number)ptStatistics->uiLastAckedSequenceNr);
+#endif
+		lua_setfield(ptLuaState, -2, "last_acked");
 	}
-	/* Construct the version. */
-	snprintf(acVersion, sizeof(acVersion), "%s-librdkafka-%s", DIST_VERSION, rd_kafka_version_str());
-	printf("RdKafkaCore(%p): Setting version to '%s'.\n", this, acVersion);
-	tCfgRes = rd_kafka_conf_set(ptConf, "client.software.version", acVersion, acError, sizeof(acError));
-	if(tCfgRes)
+}
+
+
+
+static void kafka_update_delivery_statistics(KAFKA_DELIVERY_STATISTICS_T *ptStatistics, rd_kafka_resp_err_t tError, size_t sizLength)
+{
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
 	{
-		fprintf(stderr, "Failed to set 'client.software.version': %s\n", acError);
+		++ptStatistics->ullDelivered;
+		ptStatistics->ullBytes += sizLength;
+	}
+	else
+	{
+		++ptStatistics->ullFailed;
 	}
 }
 
 
-
-void RdKafkaCore::createCore(const char *pcBrokerList, lua_State *ptLuaState, lua_State *ptLuaStateForConfig, int iConfigTableIndex)
+static void kafka_sleep_ms(unsigned int uiMilliseconds)
 {
-	rd_kafka_conf_t *ptConf;
-	rd_kafka_t *ptRk;
-	int iResult;
-	rd_kafka_conf_res_t tConfRes;
-	char acError[512];
+#if defined(_WIN32)
+	Sleep(uiMilliseconds);
+#else
+	struct timespec tDelay;
 
 
-	ptConf = rd_kafka_conf_new();
-	setClientId(ptConf);
+	tDelay.tv_sec = uiMilliseconds / 1000;
+	tDelay.tv_nsec = (long)(uiMilliseconds % 1000) * 1000000L;
+	nanosleep(&tDelay, NULL);
+#endif
+}
 
-	/* Set the bootstrap server as "bootstrap.servers" in the configuration. */
-	tConfRes = rd_kafka_conf_set(ptConf, "bootstrap.servers", pcBrokerList, acError, sizeof(acError));
-	if( tConfRes!=RD_KAFKA_CONF_OK )
+
+
+static void kafka_latency_record(KAFKA_LATENCY_HISTOGRAM_T *ptHistogram, uint64_t ullValue)
+{
+	unsigned int uiExponent;
+	unsigned int uiBucket;
+
+
+	if( ullValue<KAFKA_LATENCY_SUB_BUCKETS )
 	{
-		rd_kafka_conf_destroy(ptConf);
-		luaL_error(ptLuaState, "Failed to set the bootstrap servers: %s", acError);
+		uiBucket = (unsigned int)ullValue;
 	}
 	else
 	{
-		iResult = 0;
-		if( ptLuaStateForConfig!=NULL )
-		{
-			iResult = load_conf(ptLuaState, ptConf, iConfigTableIndex);
-		}
-		if( iResult!=0 )
+		/* Get the position of the highest set bit. */
+		uiExponent = 63U - (unsigned int)__builtin_clzll(ullValue);
+		if( uiExponent>=KAFKA_LATENCY_MAX_BITS )
 		{
-			rd_kafka_conf_destroy(ptConf);
-			luaL_error(ptLuaState, "Failed to read the config.");
+			uiBucket = KAFKA_LATENCY_BUCKETS - 1U;
 		}
 		else
 		{
-			rd_kafka_conf_set_opaque(ptConf, this);
-			rd_kafka_conf_set_dr_msg_cb(ptConf, RdKafkaCore::messageCallbackStatic);
-			rd_kafka_conf_set_error_cb(ptConf, RdKafkaCore::errorCallbackStatic);
-			rd_kafka_conf_set_log_cb(ptConf, NULL); // disable logging
-			rd_kafka_conf_set_stats_cb(ptConf, NULL); // disable stats
-
-			ptRk = rd_kafka_new(RD_KAFKA_PRODUCER, ptConf, acError, sizeof(acError));
-			if( ptRk==NULL )
-			{
-				rd_kafka_conf_destroy(ptConf); // the producer has not taken ownership
-				fprintf(stderr, "rd_kafka_new failed: %s\n", acError);
-				luaL_error(ptLuaState, "rd_kafka_new failed: %s", acError);
-			}
-			else
-			{
-				m_ptRk = ptRk;
-			}
+			uiBucket = KAFKA_LATENCY_SUB_BUCKETS + (uiExponent-KAFKA_LATENCY_SUB_BUCKET_BITS)*KAFKA_LATENCY_SUB_BUCKETS;
+			uiBucket += (unsigned int)((ullValue >> (uiExponent-KAFKA_LATENCY_SUB_BUCKET_BITS)) & (KAFKA_LATENCY_SUB_BUCKETS-1U));
 		}
 	}
+	++ptHistogram->aullBuckets[uiBucket];
+
+	if( ptHistogram->ullCount==0 || ullValue<ptHistogram->ullMin )
+	{
+		ptHistogram->ullMin = ullValue;
+	}
+	if( ullValue>ptHistogram->ullMax )
+	{
+		ptHistogram->ullMax = ullValue;
+	}
+	++ptHistogram->ullCount;
+	ptHistogram->ullSum += ullValue;
 }
 
 
 
-void RdKafkaCore::reference(void)
+/* Get the value for a percentile. This is the middle of the bucket which
+ * contains the percentile, limited by the minimum and maximum.
+ */
+static uint64_t kafka_latency_percentile(const KAFKA_LATENCY_HISTOGRAM_T *ptHistogram, double dPercentile)
 {
-	++m_uiReferenceCounter;
-	printf("RdKafkaCore(%p): Increasing the reference count to %d.\n", this, m_uiReferenceCounter);
-}
+	uint64_t ullTarget;
+	uint64_t ullSeen;
+	unsigned int uiBucket;
+	unsigned int uiExponent;
+	uint64_t ullLow;
+	uint64_t ullWidth;
+	uint64_t ullValue;
 
 
+	ullTarget = (uint64_t)(dPercentile * (double)(ptHistogram->ullCount) / 100.0 + 0.5);
+	if( ullTarget==0 )
+	{
+		ullTarget = 1;
+	}
 
-void RdKafkaCore::dereference(void)
-{
-	--m_uiReferenceCounter;
-	printf("RdKafkaCore(%p): Decreasing the reference count to %d.\n", this, m_uiReferenceCounter);
-	if( m_uiReferenceCounter==0 )
+	ullSeen = 0;
+	uiBucket = 0;
+	while( uiBucket<(KAFKA_LATENCY_BUCKETS-1U) )
 	{
-		printf("RdKafkaCore(%p): All references gone, deleting.\n", this);
-		delete this;
+		ullSeen += ptHistogram->aullBuckets[uiBucket];
+		if( ullSeen>=ullTarget )
+		{
+			break;
+		}
+		++uiBucket;
+	}
+
+	if( uiBucket<KAFKA_LATENCY_SUB_BUCKETS )
+	{
+		ullValue = uiBucket;
+	}
+	else
+	{
+		uiExponent = KAFKA_LATENCY_SUB_BUCKET_BITS + (uiBucket-KAFKA_LATENCY_SUB_BUCKETS) / KAFKA_LATENCY_SUB_BUCKETS;
+		ullWidth = 1ULL << (uiExponent - KAFKA_LATENCY_SUB_BUCKET_BITS);
+		ullLow = (1ULL << uiExponent) + ((uint64_t)((uiBucket-KAFKA_LATENCY_SUB_BUCKETS) % KAFKA_LATENCY_SUB_BUCKETS) * ullWidth);
+		ullValue = ullLow + (ullWidth / 2U);
+	}
+
+	if( ullValue<ptHistogram->ullMin )
+	{
+		ullValue = ptHistogram->ullMin;
+	}
+	if( ullValue>ptHistogram->ullMax )
+	{
+		ullValue = ptHistogram->ullMax;
 	}
+
+	return ullValue;
 }
 
 
 
-void RdKafkaCore::messageCallbackStatic(rd_kafka_t *ptRk, const rd_kafka_message_t *ptRkMessage, void *pvOpaque)
+/* Get a monotonic time in microseconds. */
+static uint64_t kafka_get_time_us(void)
 {
-	RdKafkaCore *ptThis;
+#if defined(_WIN32)
+	LARGE_INTEGER tFrequency;
+	LARGE_INTEGER tCounter;
 
 
-	ptThis = (RdKafkaCore*)pvOpaque;
-	ptThis->messageCallback(ptRk, ptRkMessage);
+	QueryPerformanceFrequency(&tFrequency);
+	QueryPerformanceCounter(&tCounter);
+	return ((uint64_t)(tCounter.QuadPart / tFrequency.QuadPart) * 1000000U) + (((uint64_t)(tCounter.QuadPart % tFrequency.QuadPart) * 1000000U) / (uint64_t)(tFrequency.QuadPart));
+#else
+	struct timespec tNow;
+
+
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return ((uint64_t)tNow.tv_sec * 1000000U) + ((uint64_t)tNow.tv_nsec / 1000U);
+#endif
 }
 
 
 
-void RdKafkaCore::messageCallback(rd_kafka_t *ptRk, const rd_kafka_message_t *ptRkMessage)
+/* Get a monotonic time in milliseconds. */
+static uint64_t kafka_get_time_ms(void)
 {
-	rd_kafka_topic_t *ptTopic;
-	void *pvTopic;
-	Topic *ptTopicObject;
-	uintptr_t uiSequenceNr;
+	return kafka_get_time_us() / 1000U;
+}
 
 
-	/* Try to get the pointer to the topic object. */
-	pvTopic = NULL;
-	ptTopic = ptRkMessage->rkt;
-	if( ptTopic!=NULL )
-	{
-		pvTopic = rd_kafka_topic_opaque(ptRkMessage->rkt);
-	}
-	if( pvTopic!=NULL )
-	{
-		ptTopicObject = (Topic*)pvTopic;
-		ptTopicObject->onMessage(ptRkMessage);
-	}
-	else
-	{
-		/* No topic object available. Try to print something here. */
-		uiSequenceNr = (uintptr_t)(ptRkMessage->_private);
-		m_pvMsgOpaque = ptRkMessage->_private;
-		if( ptRkMessage->err==RD_KAFKA_RESP_ERR_NO_ERROR )
-		{
-			printf("RdKafkaCore(%p): Message %" PRIuPTR " delivered.\n", this, uiSequenceNr);
-		}
-		else
-		{
-			++m_uiFailures;
-			printf("RdKafkaCore(%p): Failed to deliver message %" PRIuPTR ": %s\n", this, uiSequenceNr, rd_kafka_err2str(ptRkMessage->err));
-		}
-	}
+
+/* Return a monotonic time in microseconds. This is for measurements in
+ * LUA scripts, os.clock and os.time are too coarse.
+ */
+double monotonic_us(void)
+{
+	return (double)kafka_get_time_us();
 }
 
 
 
-void RdKafkaCore::errorCallbackStatic(rd_kafka_t *ptRk, int iErr, const char *pcReason, void *pvOpaque)
+/* Read an unsigned configuration value. Return the default if it can not be
+ * read.
+ */
+static unsigned int kafka_get_conf_uint(rd_kafka_t *ptRk, const char *pcName, unsigned int uiDefault)
 {
-	RdKafkaCore *ptThis;
+	char acValue[32];
+	size_t sizValue;
+	rd_kafka_conf_res_t tConfRes;
+	unsigned int uiValue;
+	char *pcEnd;
 
 
-	ptThis = (RdKafkaCore*)pvOpaque;
-	ptThis->errorCallback(ptRk, iErr, pcReason);
+	uiValue = uiDefault;
+	sizValue = sizeof(acValue);
+	tConfRes = rd_kafka_conf_get(rd_kafka_conf(ptRk), pcName, acValue, &sizValue);
+	if( tConfRes==RD_KAFKA_CONF_OK )
+	{
+		uiValue = (unsigned int)strtoul(acValue, &pcEnd, 10);
+		if( pcEnd==acValue )
+		{
+			uiValue = uiDefault;
+		}
+	}
+
+	return uiValue;
 }
 
 
 
-void RdKafkaCore::errorCallback(rd_kafka_t *ptRk, int iErr, const char *pcReason)
+/* This is the state of the JSON parser for the statistics. */
+typedef struct KAFKA_JSON_PARSER_STRUCT
 {
-	fprintf(stderr, "RdKafkaCore(%p): rdkafka error %d: %s\n", this, iErr, pcReason);
-}
+	const char *pcCnt;
+	const char *pcEnd;
+	unsigned int uiDepth;
+} KAFKA_JSON_PARSER_T;
 
+/* Stop at documents with more levels than this. */
+#define KAFKA_JSON_MAX_DEPTH 32
 
 
-rd_kafka_t *RdKafkaCore::_getRk(void)
+static void kafka_json_skip_whitespace(KAFKA_JSON_PARSER_T *ptParser)
 {
-	return m_ptRk;
+	while( ptParser->pcCnt<ptParser->pcEnd && (*(ptParser->pcCnt)==' ' || *(ptParser->pcCnt)=='\t' || *(ptParser->pcCnt)=='\n' || *(ptParser->pcCnt)=='\r') )
+	{
+		++ptParser->pcCnt;
+	}
 }
 
 
 
-void RdKafkaCore::poll(int iTimeout, void **ppvMsgOpaque, unsigned int *puiFailures)
+static int kafka_json_get_hex4(KAFKA_JSON_PARSER_T *ptParser, unsigned long *pulValue)
 {
-	m_pvMsgOpaque = NULL;
-	m_uiFailures = 0;
+	unsigned long ulValue;
+	unsigned int uiCnt;
+	char cDigit;
+	int iResult;
 
-	rd_kafka_poll(m_ptRk, iTimeout);
 
-	*ppvMsgOpaque = m_pvMsgOpaque;
-	*puiFailures = m_uiFailures;
+	iResult = 0;
+	ulValue = 0;
+	if( (ptParser->pcEnd-ptParser->pcCnt)<4 )
+	{
+		iResult = -1;
+	}
+	else
+	{
+		for(uiCnt=0; uiCnt<4; ++uiCnt)
+		{
+			cDigit = *(ptParser->pcCnt++);
+			ulValue <<= 4;
+			if( cDigit>='0' && cDigit<='9' )
+			{
+				ulValue |= (unsigned long)(cDigit - '0');
+			}
+			else if( cDigit>='a' && cDigit<='f' )
+			{
+				ulValue |= (unsigned long)(cDigit - 'a' + 10);
+			}
+			else if( cDigit>='A' && cDigit<='F' )
+			{
+				ulValue |= (unsigned long)(cDigit - 'A' + 10);
+			}
+			else
+			{
+				iResult = -1;
+			}
+		}
+	}
+	*pulValue = ulValue;
+
+	return iResult;
 }
 
 
 
-int RdKafkaCore::flush(int iTimeout)
+/* Push a JSON string as a LUA string. The parser points to the opening
+ * quote.
+ */
+static int kafka_json_push_string(lua_State *ptLuaState, KAFKA_JSON_PARSER_T *ptParser)
 {
-	rd_kafka_resp_err_t tResult;
+	luaL_Buffer tBuffer;
+	char cChar;
+	unsigned long ulCodePoint;
+	unsigned long ulLow;
 	int iResult;
+	int iDone;
 
 
-	tResult = rd_kafka_flush(m_ptRk, iTimeout);
-	iResult = (int)(tResult);
+	iResult = 0;
+	iDone = 0;
+	++ptParser->pcCnt;
+	luaL_buffinit(ptLuaState, &tBuffer);
+	while( iResult==0 && iDone==0 )
+	{
+		if( ptParser->pcCnt>=ptParser->pcEnd )
+		{
+			iResult = -1;
+		}
+		else
+		{
+			cChar = *(ptParser->pcCnt++);
+			if( cChar=='"' )
+			{
+				iDone = 1;
+			}
+			else if( cChar!='\\' )
+			{
+				luaL_addchar(&tBuffer, cChar);
+			}
+			else if( ptParser->pcCnt>=ptParser->pcEnd )
+			{
+				iResult = -1;
+			}
+			else
+			{
+				cChar = *(ptParser->pcCnt++);
+				switch(cChar)
+				{
+				case '"':
+				case '\\':
+				case '/':
+					luaL_addchar(&tBuffer, cChar);
+					break;
+				case 'b':
+					luaL_addchar(&tBuffer, '\b');
+					break;
+				case 'f':
+					luaL_addchar(&tBuffer, '\f');
+					break;
+				case 'n':
+					luaL_addchar(&tBuffer, '\n');
+					break;
+				case 'r':
+					luaL_addchar(&tBuffer, '\r');
+					break;
+				case 't':
+					luaL_addchar(&tBuffer, '\t');
+					break;
+				case 'u':
+					iResult = kafka_json_get_hex4(ptParser, &ulCodePoint);
+					if( iResult==0 && ulCodePoint>=0xd800 && ulCodePoint<0xe000 )
+					{
+						/* Combine a surrogate pair. An escape after a high
+						 * surrogate which is no low surrogate is left for
+						 * the next loop.
+						 */
+						ulLow = 0;
+						if( ulCodePoint<0xdc00 && (ptParser->pcEnd-ptParser->pcCnt)>=6 && ptParser->pcCnt[0]=='\\' && ptParser->pcCnt[1]=='u' )
+						{
+							ptParser->pcCnt += 2;
+							iResult = kafka_json_get_hex4(ptParser, &ulLow);
+							if( iResult==0 && (ulLow<0xdc00 || ulLow>=0xe000) )
+							{
+								ptParser->pcCnt -= 6;
+								ulLow = 0;
+							}
+						}
+
+						if( ulLow!=0 )
+						{
+							ulCodePoint = 0x10000 + ((ulCodePoint - 0xd800) << 10) + (ulLow - 0xdc00);
+						}
+						else
+						{
+							/* Replace an unpaired surrogate. */
+							ulCodePoint = 0xfffd;
+						}
+					}
+					if( iResult==0 )
+					{
+						/* Encode the code point as UTF-8. */
+						if( ulCodePoint<0x80 )
+						{
+							luaL_addchar(&tBuffer, (char)ulCodePoint);
+						}
+						else if( ulCodePoint<0x800 )
+						{
+							luaL_addchar(&tBuffer, (char)(0xc0 | (ulCodePoint >> 6)));
+							luaL_addchar(&tBuffer, (char)(0x80 | (ulCodePoint & 0x3f)));
+						}
+						else if( ulCodePoint<0x10000 )
+						{
+							luaL_addchar(&tBuffer, (char)(0xe0 | (ulCodePoint >> 12)));
+							luaL_addchar(&tBuffer, (char)(0x80 | ((ulCodePoint >> 6) & 0x3f)));
+							luaL_addchar(&tBuffer, (char)(0x80 | (ulCodePoint & 0x3f)));
+						}
+						else
+						{
+							luaL_addchar(&tBuffer, (char)(0xf0 | (ulCodePoint >> 18)));
+							luaL_addchar(&tBuffer, (char)(0x80 | ((ulCodePoint >> 12) & 0x3f)));
+							luaL_addchar(&tBuffer, (char)(0x80 | ((ulCodePoint >> 6) & 0x3f)));
+							luaL_addchar(&tBuffer, (char)(0x80 | (ulCodePoint & 0x3f)));
+						}
+					}
+					break;
+				default:
+					iResult = -1;
+					break;
+				}
+			}
+		}
+	}
+	luaL_pushresult(&tBuffer);
+
 	return iResult;
 }
 
 
 
+static int kafka_json_push_number(lua_State *ptLuaState, KAFKA_JSON_PARSER_T *ptParser)
+{
+	const char *pcStart;
+	char acNumber[64];
+	size_t sizNumber;
+	bool fIsInteger;
+	char *pcEnd;
+	int iResult;
+
+
+	iResult = 0;
+	fIsInteger = true;
+	pcStart = ptParser->pcCnt;
+	while( ptParser->pcCnt<ptParser->pcEnd && strchr("+-0123456789.eE", *(ptParser->pcCnt))!=NULL )
+	{
+		if( *(ptParser->pcCnt)=='.' || *(ptParser->pcCnt)=='e' || *(ptParser->pcCnt)=='E' )
+		{
+			fIsInteger = false;
+		}
+		++ptParser->pcCnt;
+	}
+
+	/* The document is not terminated, copy the number. */
+	sizNumber = (size_t)(ptParser->pcCnt - pcStart);
+	if( sizNumber==0 || sizNumber>=sizeof(acNumber) )
+	{
+		iResult = -1;
+	}
+	else
+	{
+		memcpy(acNumber, pcStart, sizNumber);
+		acNumber[sizNumber] = 0;
+#if LUA_VERSION_NUM>=504
+		if( fIsInteger==true )
+		{
+			lua_pushinteger(ptLuaState, (lua_Integer)strtoll(acNumber, &pcEnd, 10));
+		}
+		else
+		{
+			lua_pushnumber(ptLuaState, (lua_Number)strtod(acNumber, &pcEnd));
+		}
+#else
+		lua_pushnumber(ptLuaState, (lua_Number)strtod(acNumber, &pcEnd));
+#endif
+	}
+
+	return iResult;
+}
+
+
+
+/* Push the next JSON value. Objects and arrays become tables, "null" becomes
+ * nil. This returns 0 on success and -1 on a syntax error.
+ */
+static int kafka_json_push_value(lua_State *ptLuaState, KAFKA_JSON_PARSER_T *ptParser)
+{
+	int iResult;
+	char cChar;
+	size_t sizLiteral;
+	int iIndex;
+
+
+	iResult = -1;
+	kafka_json_skip_whitespace(ptParser);
+	if( ptParser->pcCnt<ptParser->pcEnd && lua_checkstack(ptLuaState, 3)!=0 )
+	{
+		sizLiteral = (size_t)(ptParser->pcEnd - ptParser->pcCnt);
+		cChar = *(ptParser->pcCnt);
+		if( cChar=='{' || cChar=='[' )
+		{
+			if( ptParser->uiDepth<KAFKA_JSON_MAX_DEPTH )
+			{
+				++ptParser->uiDepth;
+				++ptParser->pcCnt;
+				lua_newtable(ptLuaState);
+				iIndex = 1;
+				iResult = 0;
+
+				kafka_json_skip_whitespace(ptParser);
+				if( ptParser->pcCnt<ptParser->pcEnd && *(ptParser->pcCnt)==((cChar=='{') ? '}' : ']') )
+				{
+					/* This is an empty object or array. */
+					++ptParser->pcCnt;
+				}
+				else
+				{
+					do
+					{
+						if( cChar=='{' )
+						{
+							/* Get the key and the colon. */
+							kafka_json_skip_whitespace(ptParser);
+							if( ptParser->pcCnt>=ptParser->pcEnd || *(ptParser->pcCnt)!='"' )
+							{
+								iResult = -1;
+							}
+							else
+							{
+								iResult = kafka_json_push_string(ptLuaState, ptParser);
+								kafka_json_skip_whitespace(ptParser);
+								if( iResult==0 && (ptParser->pcCnt>=ptParser->pcEnd || *(ptParser->pcCnt)!=':') )
+								{
+									iResult = -1;
+								}
+								++ptParser->pcCnt;
+								if( iResult==0 )
+								{
+									iResult = kafka_json_push_value(ptLuaState, ptParser);
+								}
+								if( iResult==0 )
+								{
+									lua_rawset(ptLuaState, -3);
+								}
+								else
+								{
+									lua_pop(ptLuaState, 1);
+								}
+							}
+						}
+						else
+						{
+							iResult = kafka_json_push_value(ptLuaState, ptParser);
+							if( iResult==0 )
+							{
+								lua_rawseti(ptLuaState, -2, iIndex);
+								++iIndex;
+							}
+						}
+
+						if( iResult==0 )
+						{
+							kafka_json_skip_whitespace(ptParser);
+							if( ptParser->pcCnt>=ptParser->pcEnd )
+							{
+								iResult = -1;
+							}
+							else if( *(ptParser->pcCnt)==',' )
+							{
+								++ptParser->pcCnt;
+							}
+							else if( *(ptParser->pcCnt)==((cChar=='{') ? '}' : ']') )
+							{
+								++ptParser->pcCnt;
+								break;
+							}
+							else
+							{
+								iResult = -1;
+							}
+						}
+					} while( iResult==0 );
+				}
+
+				--ptParser->uiDepth;
+				if( iResult!=0 )
+				{
+					lua_pop(ptLuaState, 1);
+				}
+			}
+		}
+		else if( cChar=='"' )
+		{
+			iResult = kafka_json_push_string(ptLuaState, ptParser);
+			if( iResult!=0 )
+			{
+				lua_pop(ptLuaState, 1);
+			}
+		}
+		else if( sizLiteral>=4 && memcmp(ptParser->pcCnt, "true", 4)==0 )
+		{
+			ptParser->pcCnt += 4;
+			lua_pushboolean(ptLuaState, 1);
+			iResult = 0;
+		}
+		else if( sizLiteral>=5 && memcmp(ptParser->pcCnt, "false", 5)==0 )
+		{
+			ptParser->pcCnt += 5;
+			lua_pushboolean(ptLuaState, 0);
+			iResult = 0;
+		}
+		else if( sizLiteral>=4 && memcmp(ptParser->pcCnt, "null", 4)==0 )
+		{
+			ptParser->pcCnt += 4;
+			lua_pushnil(ptLuaState);
+			iResult = 0;
+		}
+		else
+		{
+			iResult = kafka_json_push_number(ptLuaState, ptParser);
+		}
+	}
+
+	return iResult;
+}
+
+
+
+/* Copy the field pcSource of the table at iSourceIndex to the field
+ * pcDestination of the table on the top of the stack. iSourceIndex must be
+ * an absolute index.
+ */
+static void kafka_copy_field(lua_State *ptLuaState, int iSourceIndex, const char *pcSource, const char *pcDestination)
+{
+	lua_getfield(ptLuaState, iSourceIndex, pcSource);
+	lua_setfield(ptLuaState, -2, pcDestination);
+}
+
+
+
+/* Build the summary of the statistics. The complete document is a table at
+ * the absolute index iStats. The summary is pushed on the stack.
+ */
+static void kafka_push_statistics_summary(lua_State *ptLuaState, int iStats)
+{
+	int iBrokers;
+	int iTopics;
+	int iPartitions;
+
+
+	lua_createtable(ptLuaState, 0, 8);
+	kafka_copy_field(ptLuaState, iStats, "ts", "ts");
+	kafka_copy_field(ptLuaState, iStats, "msg_cnt", "msg_cnt");
+	kafka_copy_field(ptLuaState, iStats, "msg_size", "msg_size");
+	kafka_copy_field(ptLuaState, iStats, "txmsgs", "txmsgs");
+	kafka_copy_field(ptLuaState, iStats, "txmsg_bytes", "txbytes");
+	kafka_copy_field(ptLuaState, iStats, "rxmsgs", "rxmsgs");
+	kafka_copy_field(ptLuaState, iStats, "rxmsg_bytes", "rxbytes");
+
+	/* Get the round trip times of all brokers in microseconds. */
+	lua_newtable(ptLuaState);
+	lua_getfield(ptLuaState, iStats, "brokers");
+	iBrokers = lua_gettop(ptLuaState);
+	if( lua_type(ptLuaState, iBrokers)==LUA_TTABLE )
+	{
+		lua_pushnil(ptLuaState);
+		while( lua_next(ptLuaState, iBrokers)!=0 )
+		{
+			if( lua_type(ptLuaState, -1)==LUA_TTABLE )
+			{
+				lua_createtable(ptLuaState, 0, 5);
+				kafka_copy_field(ptLuaState, lua_gettop(ptLuaState)-1, "outbuf_cnt", "outbuf_cnt");
+				kafka_copy_field(ptLuaState, lua_gettop(ptLuaState)-1, "waitresp_cnt", "waitresp_cnt");
+				lua_getfield(ptLuaState, -2, "rtt");
+				if( lua_type(ptLuaState, -1)==LUA_TTABLE )
+				{
+					lua_getfield(ptLuaState, -1, "p50");
+					lua_setfield(ptLuaState, -3, "rtt_p50");
+					lua_getfield(ptLuaState, -1, "p99");
+					lua_setfield(ptLuaState, -3, "rtt_p99");
+					lua_getfield(ptLuaState, -1, "avg");
+					lua_setfield(ptLuaState, -3, "rtt_avg");
+				}
+				lua_pop(ptLuaState, 1);
+
+				/* Use the broker name as the key. */
+				lua_pushvalue(ptLuaState, -3);
+				lua_insert(ptLuaState, -2);
+				lua_rawset(ptLuaState, iBrokers-1);
+			}
+			lua_pop(ptLuaState, 1);
+		}
+	}
+	lua_pop(ptLuaState, 1);
+	lua_setfield(ptLuaState, -2, "brokers");
+
+	/* Get the batch sizes and the queue depth of all partitions. */
+	lua_newtable(ptLuaState);
+	lua_getfield(ptLuaState, iStats, "topics");
+	iTopics = lua_gettop(ptLuaState);
+	if( lua_type(ptLuaState, iTopics)==LUA_TTABLE )
+	{
+		lua_pushnil(ptLuaState);
+		while( lua_next(ptLuaState, iTopics)!=0 )
+		{
+			if( lua_type(ptLuaState, -1)==LUA_TTABLE )
+			{
+				lua_createtable(ptLuaState, 0, 2);
+				lua_getfield(ptLuaState, -2, "batchsize");
+				if( lua_type(ptLuaState, -1)==LUA_TTABLE )
+				{
+					lua_getfield(ptLuaState, -1, "avg");
+					lua_setfield(ptLuaState, -3, "batchsize_avg");
+				}
+				lua_pop(ptLuaState, 1);
+
+				lua_newtable(ptLuaState);
+				lua_getfield(ptLuaState, -3, "partitions");
+				iPartitions = lua_gettop(ptLuaState);
+				if( lua_type(ptLuaState, iPartitions)==LUA_TTABLE )
+				{
+					lua_pushnil(ptLuaState);
+					while( lua_next(ptLuaState, iPartitions)!=0 )
+					{
+						if( lua_type(ptLuaState, -1)==LUA_TTABLE )
+						{
+							lua_createtable(ptLuaState, 0, 4);
+							kafka_copy_field(ptLuaState, lua_gettop(ptLuaState)-1, "msgq_cnt", "msgq_cnt");
+							kafka_copy_field(ptLuaState, lua_gettop(ptLuaState)-1, "msgq_bytes", "msgq_bytes");
+							kafka_copy_field(ptLuaState, lua_gettop(ptLuaState)-1, "xmit_msgq_cnt", "xmit_msgq_cnt");
+							kafka_copy_field(ptLuaState, lua_gettop(ptLuaState)-1, "xmit_msgq_bytes", "xmit_msgq_bytes");
+
+							/* Use the partition number as the key. Fall back
+							 * to the key of the JSON object.
+							 */
+							lua_getfield(ptLuaState, -2, "partition");
+							if( lua_type(ptLuaState, -1)!=LUA_TNUMBER )
+							{
+								lua_pop(ptLuaState, 1);
+								lua_pushvalue(ptLuaState, -3);
+							}
+							lua_insert(ptLuaState, -2);
+							lua_rawset(ptLuaState, iPartitions-1);
+						}
+						lua_pop(ptLuaState, 1);
+					}
+				}
+				lua_pop(ptLuaState, 1);
+				lua_setfield(ptLuaState, -2, "partitions");
+
+				/* Use the topic name as the key. */
+				lua_pushvalue(ptLuaState, -3);
+				lua_insert(ptLuaState, -2);
+				lua_rawset(ptLuaState, iTopics-1);
+			}
+			lua_pop(ptLuaState, 1);
+		}
+	}
+	lua_pop(ptLuaState, 1);
+	lua_setfield(ptLuaState, -2, "topics");
+}
+
+
+
+/* Push an array with the broker IDs of a partition. */
+static void kafka_push_broker_ids(lua_State *ptLuaState, const int32_t *piIds, int iCount)
+{
+	int iCnt;
+
+
+	lua_createtable(ptLuaState, iCount, 0);
+	for(iCnt=0; iCnt<iCount; ++iCnt)
+	{
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(ptLuaState, piIds[iCnt]);
+#else
+		lua_pushnumber(ptLuaState, piIds[iCnt]);
+#endif
+		lua_rawseti(ptLuaState, -2, iCnt+1);
+	}
+}
+
+
+
+/* Push the cluster metadata as a table. The field "brokers" has one entry
+ * per broker ID with the fields "host" and "port". The field "topics" has
+ * one entry per topic name with the fields "partition_count", "error" and
+ * "partitions". The partitions are indexed by their ID, which starts at 0.
+ * Each partition has the fields "leader", "replicas", "isrs" and "error".
+ * An error field is nil if there is no error.
+ */
+static void kafka_push_metadata(lua_State *ptLuaState, const struct rd_kafka_metadata *ptMetadata)
+{
+	int iBrokerCnt;
+	int iTopicCnt;
+	int iPartitionCnt;
+	const struct rd_kafka_metadata_broker *ptBroker;
+	const struct rd_kafka_metadata_topic *ptTopic;
+	const struct rd_kafka_metadata_partition *ptPartition;
+
+
+	lua_createtable(ptLuaState, 0, 3);
+
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptLuaState, ptMetadata->orig_broker_id);
+#else
+	lua_pushnumber(ptLuaState, ptMetadata->orig_broker_id);
+#endif
+	lua_setfield(ptLuaState, -2, "orig_broker_id");
+
+	lua_createtable(ptLuaState, 0, ptMetadata->broker_cnt);
+	for(iBrokerCnt=0; iBrokerCnt<ptMetadata->broker_cnt; ++iBrokerCnt)
+	{
+		ptBroker = ptMetadata->brokers + iBrokerCnt;
+		lua_createtable(ptLuaState, 0, 2);
+		lua_pushstring(ptLuaState, ptBroker->host);
+		lua_setfield(ptLuaState, -2, "host");
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(ptLuaState, ptBroker->port);
+#else
+		lua_pushnumber(ptLuaState, ptBroker->port);
+#endif
+		lua_setfield(ptLuaState, -2, "port");
+		lua_rawseti(ptLuaState, -2, ptBroker->id);
+	}
+	lua_setfield(ptLuaState, -2, "brokers");
+
+	lua_createtable(ptLuaState, 0, ptMetadata->topic_cnt);
+	for(iTopicCnt=0; iTopicCnt<ptMetadata->topic_cnt; ++iTopicCnt)
+	{
+		ptTopic = ptMetadata->topics + iTopicCnt;
+		lua_createtable(ptLuaState, 0, 3);
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(ptLuaState, ptTopic->partition_cnt);
+#else
+		lua_pushnumber(ptLuaState, ptTopic->partition_cnt);
+#endif
+		lua_setfield(ptLuaState, -2, "partition_count");
+		if( ptTopic->err!=RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+#if LUA_VERSION_NUM>=504
+			lua_pushinteger(ptLuaState, ptTopic->err);
+#else
+			lua_pushnumber(ptLuaState, ptTopic->err);
+#endif
+			lua_setfield(ptLuaState, -2, "error");
+		}
+
+		lua_createtable(ptLuaState, ptTopic->partition_cnt, 1);
+		for(iPartitionCnt=0; iPartitionCnt<ptTopic->partition_cnt; ++iPartitionCnt)
+		{
+			ptPartition = ptTopic->partitions + iPartitionCnt;
+			lua_createtable(ptLuaState, 0, 4);
+#if LUA_VERSION_NUM>=504
+			lua_pushinteger(ptLuaState, ptPartition->leader);
+#else
+			lua_pushnumber(ptLuaState, ptPartition->leader);
+#endif
+			lua_setfield(ptLuaState, -2, "leader");
+			kafka_push_broker_ids(ptLuaState, ptPartition->replicas, ptPartition->replica_cnt);
+			lua_setfield(ptLuaState, -2, "replicas");
+			kafka_push_broker_ids(ptLuaState, ptPartition->isrs, ptPartition->isr_cnt);
+			lua_setfield(ptLuaState, -2, "isrs");
+			if( ptPartition->err!=RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+#if LUA_VERSION_NUM>=504
+				lua_pushinteger(ptLuaState, ptPartition->err);
+#else
+				lua_pushnumber(ptLuaState, ptPartition->err);
+#endif
+				lua_setfield(ptLuaState, -2, "error");
+			}
+			lua_rawseti(ptLuaState, -2, ptPartition->id);
+		}
+		lua_setfield(ptLuaState, -2, "partitions");
+
+		lua_setfield(ptLuaState, -2, ptTopic->topic);
+	}
+	lua_setfield(ptLuaState, -2, "topics");
+}
+
+
+
+/* This is the entry point of the background thread of a core. */
+#if defined(_WIN32)
+static DWORD WINAPI kafka_background_thread(LPVOID pvParameter)
+{
+	((RdKafkaCore*)pvParameter)->backgroundPoll();
+	return 0;
+}
+#else
+static void *kafka_background_thread(void *pvParameter)
+{
+	((RdKafkaCore*)pvParameter)->backgroundPoll();
+	return NULL;
+}
+#endif
+
+
+
+/* These are all shared cores of the process. Several LUA states might run
+ * in different threads, so the list is protected by a lock.
+ */
+#if defined(_WIN32)
+static SRWLOCK s_tSharedCoresLock = SRWLOCK_INIT;
+#else
+static pthread_mutex_t s_tSharedCoresLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static RdKafkaCore *s_ptSharedCores = NULL;
+
+
+static void kafka_lock_shared_cores(void)
+{
+#if defined(_WIN32)
+	AcquireSRWLockExclusive(&s_tSharedCoresLock);
+#else
+	pthread_mutex_lock(&s_tSharedCoresLock);
+#endif
+}
+
+
+
+static void kafka_unlock_shared_cores(void)
+{
+#if defined(_WIN32)
+	ReleaseSRWLockExclusive(&s_tSharedCoresLock);
+#else
+	pthread_mutex_unlock(&s_tSharedCoresLock);
+#endif
+}
+
+
+
+static int kafka_compare_strings(const void *pvA, const void *pvB)
+{
+	return strcmp(*(const char * const *)pvA, *(const char * const *)pvB);
+}
+
+
+
+/* Push a string which identifies the config table at iConfigTableIndex. It
+ * has one "key=value" line for each entry. The values are converted like
+ * in "load_conf". The entries are sorted as the order of a LUA table is
+ * random. iConfigTableIndex is 0 if there is no config table.
+ */
+static void kafka_push_config_key(lua_State *ptLuaState, int iConfigTableIndex)
+{
+	int iEntriesIndex;
+	int iType;
+	const char *pcKey;
+	size_t sizEntries;
+	size_t sizCnt;
+	const char **ppcEntries;
+	luaL_Buffer tBuffer;
+
+
+	if( iConfigTableIndex==0 )
+	{
+		lua_pushstring(ptLuaState, "");
+	}
+	else
+	{
+		/* Collect all entries as "key=value" strings in a new table. */
+		lua_newtable(ptLuaState);
+		iEntriesIndex = lua_gettop(ptLuaState);
+		sizEntries = 0;
+		lua_pushnil(ptLuaState);
+		while( lua_next(ptLuaState, iConfigTableIndex)!=0 )
+		{
+			/* Do not convert the key in place, this would confuse lua_next. */
+			if( lua_type(ptLuaState, -2)==LUA_TSTRING )
+			{
+				pcKey = lua_tostring(ptLuaState, -2);
+			}
+			else
+			{
+				pcKey = lua_typename(ptLuaState, lua_type(ptLuaState, -2));
+			}
+
+			iType = lua_type(ptLuaState, -1);
+			if( iType==LUA_TSTRING )
+			{
+				lua_pushfstring(ptLuaState, "%s=%s", pcKey, lua_tostring(ptLuaState, -1));
+			}
+			else if( iType==LUA_TNUMBER )
+			{
+				lua_pushfstring(ptLuaState, "%s=%d", pcKey, (int)lua_tointeger(ptLuaState, -1));
+			}
+			else if( iType==LUA_TBOOLEAN )
+			{
+				lua_pushfstring(ptLuaState, "%s=%s", pcKey, (lua_toboolean(ptLuaState, -1)!=0) ? "true" : "false");
+			}
+			else
+			{
+				lua_pushfstring(ptLuaState, "%s=<%s>", pcKey, lua_typename(ptLuaState, iType));
+			}
+			++sizEntries;
+			lua_rawseti(ptLuaState, iEntriesIndex, (int)sizEntries);
+
+			/* Remove the value, keep the key for lua_next. */
+			lua_pop(ptLuaState, 1);
+		}
+
+		ppcEntries = NULL;
+		if( sizEntries!=0 )
+		{
+			ppcEntries = (const char**)malloc(sizEntries * sizeof(const char*));
+			if( ppcEntries==NULL )
+			{
+				luaL_error(ptLuaState, "Failed to allocate memory for the config key.");
+			}
+			/* The strings stay in the table, so the pointers are valid. */
+			for(sizCnt=0; sizCnt<sizEntries; ++sizCnt)
+			{
+				lua_rawgeti(ptLuaState, iEntriesIndex, (int)(sizCnt+1));
+				ppcEntries[sizCnt] = lua_tostring(ptLuaState, -1);
+				lua_pop(ptLuaState, 1);
+			}
+			qsort(ppcEntries, sizEntries, sizeof(const char*), kafka_compare_strings);
+		}
+
+		luaL_buffinit(ptLuaState, &tBuffer);
+		for(sizCnt=0; sizCnt<sizEntries; ++sizCnt)
+		{
+			luaL_addstring(&tBuffer, ppcEntries[sizCnt]);
+			luaL_addchar(&tBuffer, '\n');
+		}
+		luaL_pushresult(&tBuffer);
+
+		if( ppcEntries!=NULL )
+		{
+			free(ppcEntries);
+		}
+
+		/* Replace the table with the key. */
+		lua_replace(ptLuaState, iEntriesIndex);
+	}
+}
+
+
+
+/* Push a string which identifies a shared core. It contains the main LUA
+ * state, the type of the handle, the broker list and the config key.
+ */
+static void kafka_push_shared_core_key(lua_State *ptLuaState, rd_kafka_type_t tType, const char *pcBrokerList, int iConfigTableIndex)
+{
+	lua_State *ptMainState;
+
+
+	/* The cores are shared in one LUA state, not across states. */
+#if LUA_VERSION_NUM>=502
+	lua_rawgeti(ptLuaState, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	ptMainState = lua_tothread(ptLuaState, -1);
+	lua_pop(ptLuaState, 1);
+#else
+	ptMainState = ptLuaState;
+#endif
+
+	lua_pushfstring(ptLuaState, "%p\n%d\n%s\n", ptMainState, (int)tType, pcBrokerList);
+	kafka_push_config_key(ptLuaState, iConfigTableIndex);
+	lua_concat(ptLuaState, 2);
+}
+
+
+
+/* Set the fields of a consumed message in the table on the top of the stack.
+ * All fields are set, missing values are set to nil. This allows to reuse
+ * old message tables.
+ */
+static void kafka_fill_message_table(lua_State *ptLuaState, const rd_kafka_message_t *ptRkMessage)
+{
+	int64_t llTimestamp;
+	rd_kafka_timestamp_type_t tTimestampType;
+
+
+	/* The payload and the key are binary safe. */
+	if( ptRkMessage->payload!=NULL )
+	{
+		lua_pushlstring(ptLuaState, (const char*)(ptRkMessage->payload), ptRkMessage->len);
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "value");
+
+	if( ptRkMessage->key!=NULL )
+	{
+		lua_pushlstring(ptLuaState, (const char*)(ptRkMessage->key), ptRkMessage->key_len);
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "key");
+
+	if( ptRkMessage->rkt!=NULL )
+	{
+		lua_pushstring(ptLuaState, rd_kafka_topic_name(ptRkMessage->rkt));
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "topic");
+
+	llTimestamp = rd_kafka_message_timestamp(ptRkMessage, &tTimestampType);
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptLuaState, ptRkMessage->partition);
+	lua_setfield(ptLuaState, -2, "partition");
+	lua_pushinteger(ptLuaState, (lua_Integer)ptRkMessage->offset);
+	lua_setfield(ptLuaState, -2, "offset");
+	if( tTimestampType!=RD_KAFKA_TIMESTAMP_NOT_AVAILABLE )
+	{
+		lua_pushinteger(ptLuaState, (lua_Integer)llTimestamp);
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "timestamp");
+	/* The error is nil for a valid message. */
+	if( ptRkMessage->err!=RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		lua_pushinteger(ptLuaState, ptRkMessage->err);
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "error");
+#else
+	lua_pushnumber(ptLuaState, ptRkMessage->partition);
+	lua_setfield(ptLuaState, -2, "partition");
+	lua_pushnumber(ptLuaState, (lua_Number)ptRkMessage->offset);
+	lua_setfield(ptLuaState, -2, "offset");
+	if( tTimestampType!=RD_KAFKA_TIMESTAMP_NOT_AVAILABLE )
+	{
+		lua_pushnumber(ptLuaState, (lua_Number)llTimestamp);
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "timestamp");
+	/* The error is nil for a valid message. */
+	if( ptRkMessage->err!=RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		lua_pushnumber(ptLuaState, ptRkMessage->err);
+	}
+	else
+	{
+		lua_pushnil(ptLuaState);
+	}
+	lua_setfield(ptLuaState, -2, "error");
+#endif
+}
+
+
+/*--------------------------------------------------------------------------*/
+
+RdKafkaCore::RdKafkaCore(void)
+ : m_uiReferenceCounter(0)
+ , m_tType(RD_KAFKA_PRODUCER)
+ , m_ptRk(NULL)
+ , m_uiFailures(0)
+ , m_pvMsgOpaque(NULL)
+ , m_ptFreeMessageOpaques(NULL)
+ , m_ptTopicStates(NULL)
+ , m_fVerbose(false)
+ , m_uiShard(0)
+ , m_fCollectReports(false)
+ , m_ptReports(NULL)
+ , m_sizReports(0)
+ , m_sizReportsMax(0)
+ , m_ulReportsLost(0)
+ , m_fReportsPolled(false)
+ , m_ptPendingReports(NULL)
+ , m_sizPendingReports(0)
+ , m_sizPendingReportsMax(0)
+ , m_ptCallbackLuaState(NULL)
+ , m_iDeliveryCallback(LUA_NOREF)
+ , m_uiTopicCallbacks(0)
+ , m_fInDeliveryCallback(false)
+ , m_fBackgroundPoll(false)
+ , m_iBackgroundStop(0)
+ , m_iBackgroundFinished(0)
+ , m_ptRing(NULL)
+ , m_sizRingMask(0)
+ , m_sizRingHead(0)
+ , m_sizRingTail(0)
+ , m_ptEventQueue(NULL)
+ , m_uiQueueMaxMessages(0)
+ , m_uiQueueMaxKBytes(0)
+ , m_pcStatisticsPending(NULL)
+ , m_pcStatistics(NULL)
+ , m_iFatalError(0)
+ , m_pcSharedKey(NULL)
+ , m_ptNextShared(NULL)
+ , m_ptMetadata(NULL)
+ , m_ullMetadataTime(0)
+ , m_uiMetadataRefresh(0)
+{
+	m_aiEventPipe[0] = -1;
+	m_aiEventPipe[1] = -1;
+	memset(&m_tStatistics, 0, sizeof(KAFKA_DELIVERY_STATISTICS_T));
+	memset(&m_tBackgroundThread, 0, sizeof(KAFKA_THREAD_T));
+}
+
+
+
+RdKafkaCore::~RdKafkaCore(void)
+{
+	rd_kafka_resp_err_t tResult;
+	int iMessages;
+	KAFKA_MESSAGE_OPAQUE_T *ptOpaque;
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+	KAFKA_TOPIC_HANDLE_T *ptHandle;
+	uint64_t ullStart;
+
+
+	/* Nobody else may poll the handle from now on. */
+	stopBackgroundPoll();
+
+	if( m_ptRk!=NULL && m_tType==RD_KAFKA_CONSUMER )
+	{
+		/* Leave the consumer group and commit the offsets. */
+		tResult = rd_kafka_consumer_close(m_ptRk);
+		if( tResult!=RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			fprintf(stderr, "RdKafkaCore(%p): failed to close the consumer: %s\n", this, rd_kafka_err2str(tResult));
+		}
+	}
+	else if( m_ptRk!=NULL )
+	{
+		/* Try to flush any waiting messages.
+		 * Wait for a maximum of 2 seconds.
+		 */
+		tResult = rd_kafka_flush(m_ptRk, 2000);
+		if( tResult!=RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			/* Show an error. */
+			iMessages = rd_kafka_outq_len(m_ptRk);
+			fprintf(stderr, "RdKafkaCore(%p): failed to flush, %d messages left in the queue: %s\n", this, iMessages, rd_kafka_err2str(tResult));
+
+			/* Purge the remaining messages. This produces delivery reports
+			 * for them, which release the anchored LUA strings of the
+			 * zero-copy mode. The reports of purged in-flight messages
+			 * arrive later, so poll until the queue is empty. Wait for a
+			 * maximum of 1 second.
+			 */
+			rd_kafka_purge(m_ptRk, RD_KAFKA_PURGE_F_QUEUE|RD_KAFKA_PURGE_F_INFLIGHT);
+			ullStart = kafka_get_time_ms();
+			do
+			{
+				rd_kafka_poll(m_ptRk, 10);
+			} while( rd_kafka_outq_len(m_ptRk)>0 && (kafka_get_time_ms()-ullStart)<1000 );
+
+			iMessages = rd_kafka_outq_len(m_ptRk);
+			if( iMessages>0 )
+			{
+				fprintf(stderr, "RdKafkaCore(%p): %d purged messages got no delivery report.\n", this, iMessages);
+			}
+		}
+	}
+
+	if( m_ptMetadata!=NULL )
+	{
+		rd_kafka_metadata_destroy(m_ptMetadata);
+		m_ptMetadata = NULL;
+	}
+
+	/* Release the topic handles before the handle is destroyed. */
+	ptTopicState = m_ptTopicStates;
+	while( ptTopicState!=NULL )
+	{
+		ptHandle = ptTopicState->ptHandles;
+		while( ptHandle!=NULL )
+		{
+			ptTopicState->ptHandles = ptHandle->ptNext;
+			rd_kafka_topic_destroy(ptHandle->ptTopic);
+			free(ptHandle->pcConfigKey);
+			free(ptHandle);
+			ptHandle = ptTopicState->ptHandles;
+		}
+		ptTopicState = ptTopicState->ptNext;
+	}
+
+	/* Stop the events before the pipe is closed. */
+	if( m_ptEventQueue!=NULL )
+	{
+		rd_kafka_queue_io_event_enable(m_ptEventQueue, -1, NULL, 0);
+		rd_kafka_queue_destroy(m_ptEventQueue);
+		m_ptEventQueue = NULL;
+	}
+
+	if( m_ptRk!=NULL )
+	{
+		rd_kafka_destroy(m_ptRk);
+		rd_kafka_wait_destroyed(1000);
+		m_ptRk = NULL;
+	}
+
+#if !defined(_WIN32)
+	if( m_aiEventPipe[0]!=-1 )
+	{
+		close(m_aiEventPipe[0]);
+		close(m_aiEventPipe[1]);
+		m_aiEventPipe[0] = -1;
+		m_aiEventPipe[1] = -1;
+	}
+#endif
+
+	/* Free all unused message opaques. */
+	ptOpaque = m_ptFreeMessageOpaques;
+	while( ptOpaque!=NULL )
+	{
+		m_ptFreeMessageOpaques = ptOpaque->ptNext;
+		free(ptOpaque);
+		ptOpaque = m_ptFreeMessageOpaques;
+	}
+
+	if( m_ptReports!=NULL )
+	{
+		free(m_ptReports);
+		m_ptReports = NULL;
+	}
+	if( m_ptPendingReports!=NULL )
+	{
+		free(m_ptPendingReports);
+		m_ptPendingReports = NULL;
+	}
+
+	if( m_ptRing!=NULL )
+	{
+		free(m_ptRing);
+		m_ptRing = NULL;
+	}
+
+	if( m_pcStatisticsPending!=NULL )
+	{
+		free(m_pcStatisticsPending);
+		m_pcStatisticsPending = NULL;
+	}
+	if( m_pcStatistics!=NULL )
+	{
+		free(m_pcStatistics);
+		m_pcStatistics = NULL;
+	}
+
+	/* Release the LUA delivery callbacks. */
+	if( m_iDeliveryCallback!=LUA_NOREF )
+	{
+		luaL_unref(m_ptCallbackLuaState, LUA_REGISTRYINDEX, m_iDeliveryCallback);
+		m_iDeliveryCallback = LUA_NOREF;
+	}
+
+	/* Free all topic states. */
+	ptTopicState = m_ptTopicStates;
+	while( ptTopicState!=NULL )
+	{
+		m_ptTopicStates = ptTopicState->ptNext;
+		if( ptTopicState->iDeliveryCallback!=LUA_NOREF )
+		{
+			luaL_unref(m_ptCallbackLuaState, LUA_REGISTRYINDEX, ptTopicState->iDeliveryCallback);
+		}
+		if( ptTopicState->ptLatency!=NULL )
+		{
+			free(ptTopicState->ptLatency);
+		}
+		free(ptTopicState->pcName);
+		free(ptTopicState);
+		ptTopicState = m_ptTopicStates;
+	}
+
+	if( m_pcSharedKey!=NULL )
+	{
+		free(m_pcSharedKey);
+		m_pcSharedKey = NULL;
+	}
+}
+
+
+
+/* Set the client software name and version in a configuration.
+ * Recommended here: https://github.com/edenhill/librdkafka/wiki/Language-bindings-development#reporting-client-software-name-and-version-to-broker
+ * Both operations are not fatal as they are only informational.
+ */
+void RdKafkaCore::setClientId(rd_kafka_conf_t *ptConf)
+{
+	rd_kafka_conf_res_t tCfgRes;
+	char acVersion[256];
+	char acError[512];
+
+
+	tCfgRes = rd_kafka_conf_set(ptConf, "client.software.name", "org.muhkuh.lua-kafka", acError, sizeof(acError));
+	if(tCfgRes)
+	{
+		fprintf(stderr, "Failed to set 'client.software.name': %s\n", acError);
+	}
+	/* Construct the version. */
+	snprintf(acVersion, sizeof(acVersion), "%s-librdkafka-%s", DIST_VERSION, rd_kafka_version_str());
+	printf("RdKafkaCore(%p): Setting version to '%s'.\n", this, acVersion);
+	tCfgRes = rd_kafka_conf_set(ptConf, "client.software.version", acVersion, acError, sizeof(acError));
+	if(tCfgRes)
+	{
+		fprintf(stderr, "Failed to set 'client.software.version': %s\n", acError);
+	}
+}
+
+
+
+/* Create a new producer or consumer instance. The group ID is only used for
+ * consumers and can be NULL.
+ */
+void RdKafkaCore::createCore(rd_kafka_type_t tType, const char *pcBrokerList, const char *pcGroupId, lua_State *ptLuaState, lua_State *ptLuaStateForConfig, int iConfigTableIndex)
+{
+	rd_kafka_conf_t *ptConf;
+	rd_kafka_t *ptRk;
+	int iResult;
+	rd_kafka_conf_res_t tConfRes;
+	char acError[512];
+
+
+	ptConf = rd_kafka_conf_new();
+	setClientId(ptConf);
+
+	/* Set the bootstrap server as "bootstrap.servers" in the configuration. */
+	tConfRes = rd_kafka_conf_set(ptConf, "bootstrap.servers", pcBrokerList, acError, sizeof(acError));
+	if( tConfRes!=RD_KAFKA_CONF_OK )
+	{
+		rd_kafka_conf_destroy(ptConf);
+		luaL_error(ptLuaState, "Failed to set the bootstrap servers: %s", acError);
+	}
+	else
+	{
+		/* Set the consumer group. */
+		if( pcGroupId!=NULL )
+		{
+			tConfRes = rd_kafka_conf_set(ptConf, "group.id", pcGroupId, acError, sizeof(acError));
+			if( tConfRes!=RD_KAFKA_CONF_OK )
+			{
+				rd_kafka_conf_destroy(ptConf);
+				luaL_error(ptLuaState, "Failed to set the group ID: %s", acError);
+			}
+		}
+
+		/* Consumers commit their offsets explicitly with "store_offset" and
+		 * "commit_async". The configuration table can still enable the
+		 * automatic commit.
+		 */
+		if( tType==RD_KAFKA_CONSUMER )
+		{
+			tConfRes = rd_kafka_conf_set(ptConf, "enable.auto.commit", "false", acError, sizeof(acError));
+			if( tConfRes!=RD_KAFKA_CONF_OK )
+			{
+				rd_kafka_conf_destroy(ptConf);
+				luaL_error(ptLuaState, "Failed to disable the automatic commit: %s", acError);
+			}
+		}
+
+		iResult = 0;
+		if( ptLuaStateForConfig!=NULL )
+		{
+			iResult = load_conf(ptLuaState, ptConf, iConfigTableIndex);
+		}
+		if( iResult!=0 )
+		{
+			rd_kafka_conf_destroy(ptConf);
+			luaL_error(ptLuaState, "Failed to read the config.");
+		}
+		else
+		{
+			rd_kafka_conf_set_opaque(ptConf, this);
+			if( tType==RD_KAFKA_PRODUCER )
+			{
+				rd_kafka_conf_set_dr_msg_cb(ptConf, RdKafkaCore::messageCallbackStatic);
+			}
+			rd_kafka_conf_set_error_cb(ptConf, RdKafkaCore::errorCallbackStatic);
+			rd_kafka_conf_set_log_cb(ptConf, NULL); // disable logging
+			/* librdkafka only calls this if "statistics.interval.ms" is
+			 * set in the configuration.
+			 */
+			rd_kafka_conf_set_stats_cb(ptConf, RdKafkaCore::statsCallbackStatic);
+
+			ptRk = rd_kafka_new(tType, ptConf, acError, sizeof(acError));
+			if( ptRk==NULL )
+			{
+				rd_kafka_conf_destroy(ptConf); // the producer has not taken ownership
+				fprintf(stderr, "rd_kafka_new failed: %s\n", acError);
+				luaL_error(ptLuaState, "rd_kafka_new failed: %s", acError);
+			}
+			else
+			{
+				m_tType = tType;
+				m_ptRk = ptRk;
+
+				/* Keep the limits for "queue_status". */
+				m_uiQueueMaxMessages = kafka_get_conf_uint(ptRk, "queue.buffering.max.messages", 0);
+				m_uiQueueMaxKBytes = kafka_get_conf_uint(ptRk, "queue.buffering.max.kbytes", 0);
+
+				/* Refresh the cached metadata as often as librdkafka does. */
+				m_uiMetadataRefresh = kafka_get_conf_uint(ptRk, "topic.metadata.refresh.interval.ms", 300000);
+
+				/* Serve all events of a consumer with the consumer queue. */
+				if( tType==RD_KAFKA_CONSUMER )
+				{
+					rd_kafka_poll_set_consumer(ptRk);
+				}
+			}
+		}
+	}
+}
+
+
+
+/* Each Message view holds a reference, so this runs once per consumed
+ * message. Print the counter only in verbose mode.
+ */
+void RdKafkaCore::reference(void)
+{
+	++m_uiReferenceCounter;
+	if( m_fVerbose==true )
+	{
+		printf("RdKafkaCore(%p): Increasing the reference count to %d.\n", this, m_uiReferenceCounter);
+	}
+}
+
+
+
+void RdKafkaCore::dereference(void)
+{
+	RdKafkaCore **pptCnt;
+
+
+	--m_uiReferenceCounter;
+	if( m_fVerbose==true )
+	{
+		printf("RdKafkaCore(%p): Decreasing the reference count to %d.\n", this, m_uiReferenceCounter);
+	}
+	if( m_uiReferenceCounter==0 )
+	{
+		/* Nobody may find a shared core from now on. */
+		if( m_pcSharedKey!=NULL )
+		{
+			kafka_lock_shared_cores();
+			pptCnt = &s_ptSharedCores;
+			while( *pptCnt!=NULL )
+			{
+				if( *pptCnt==this )
+				{
+					*pptCnt = m_ptNextShared;
+					break;
+				}
+				pptCnt = &((*pptCnt)->m_ptNextShared);
+			}
+			kafka_unlock_shared_cores();
+		}
+
+		printf("RdKafkaCore(%p): All references gone, deleting.\n", this);
+		delete this;
+	}
+}
+
+
+
+/* Find a shared core with the key from kafka_push_shared_core_key and
+ * add a reference to it. This returns NULL if there is no such core.
+ */
+RdKafkaCore *RdKafkaCore::getSharedCore(const char *pcKey)
+{
+	RdKafkaCore *ptCore;
+
+
+	kafka_lock_shared_cores();
+	ptCore = s_ptSharedCores;
+	while( ptCore!=NULL )
+	{
+		if( strcmp(ptCore->m_pcSharedKey, pcKey)==0 )
+		{
+			ptCore->reference();
+			break;
+		}
+		ptCore = ptCore->m_ptNextShared;
+	}
+	kafka_unlock_shared_cores();
+
+	return ptCore;
+}
+
+
+
+/* Offer this core to other objects with the same key. */
+void RdKafkaCore::setShared(const char *pcKey)
+{
+	m_pcSharedKey = strdup(pcKey);
+	if( m_pcSharedKey!=NULL )
+	{
+		kafka_lock_shared_cores();
+		m_ptNextShared = s_ptSharedCores;
+		s_ptSharedCores = this;
+		kafka_unlock_shared_cores();
+	}
+}
+
+
+
+void RdKafkaCore::messageCallbackStatic(rd_kafka_t *ptRk, const rd_kafka_message_t *ptRkMessage, void *pvOpaque)
+{
+	RdKafkaCore *ptThis;
+
+
+	ptThis = (RdKafkaCore*)pvOpaque;
+	ptThis->messageCallback(ptRk, ptRkMessage);
+}
+
+
+
+void RdKafkaCore::messageCallback(rd_kafka_t *ptRk, const rd_kafka_message_t *ptRkMessage)
+{
+	KAFKA_MESSAGE_OPAQUE_T *ptOpaque;
+	size_t sizHead;
+	KAFKA_RING_ENTRY_T *ptEntry;
+
+
+	ptOpaque = (KAFKA_MESSAGE_OPAQUE_T*)(ptRkMessage->_private);
+
+	if( __atomic_load_n(&m_fBackgroundPoll, __ATOMIC_ACQUIRE)==false )
+	{
+		processReport(ptOpaque, ptRkMessage->err, ptRkMessage->partition, ptRkMessage->offset, ptRkMessage->len, rd_kafka_message_latency(ptRkMessage));
+	}
+	else
+	{
+		/* This runs in the background thread. It must not touch anything
+		 * which belongs to the LUA thread. Pass the report to the ring.
+		 * Wait if the ring is full, the LUA thread empties it with the next
+		 * poll.
+		 */
+		sizHead = m_sizRingHead;
+		while( (sizHead - __atomic_load_n(&m_sizRingTail, __ATOMIC_ACQUIRE))>m_sizRingMask )
+		{
+			kafka_sleep_ms(1);
+		}
+		ptEntry = m_ptRing + (sizHead & m_sizRingMask);
+		ptEntry->ptOpaque = ptOpaque;
+		ptEntry->tError = ptRkMessage->err;
+		ptEntry->iPartition = ptRkMessage->partition;
+		ptEntry->llOffset = ptRkMessage->offset;
+		ptEntry->sizLength = ptRkMessage->len;
+		ptEntry->llLatency = rd_kafka_message_latency(ptRkMessage);
+		__atomic_store_n(&m_sizRingHead, sizHead + 1, __ATOMIC_RELEASE);
+	}
+}
+
+
+
+/* Process one delivery report in the LUA thread. */
+void RdKafkaCore::processReport(KAFKA_MESSAGE_OPAQUE_T *ptOpaque, rd_kafka_resp_err_t tError, int32_t iPartition, int64_t llOffset, size_t sizLength, int64_t llLatency)
+{
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+	uintptr_t uiSequenceNr;
+	const char *pcTopic;
+
+
+	/* Get the sequence number and the topic state from the message opaque. */
+	uiSequenceNr = 0;
+	ptTopicState = NULL;
+	if( ptOpaque!=NULL )
+	{
+		uiSequenceNr = ptOpaque->uiSequenceNr;
+		ptTopicState = ptOpaque->ptTopicState;
+	}
+
+	/* Count the message for the core and the topic. Only the topic has
+	 * the last acked sequence number, the numbers are counted per topic.
+	 */
+	kafka_update_delivery_statistics(&m_tStatistics, tError, sizLength);
+	if( ptTopicState!=NULL )
+	{
+		kafka_update_delivery_statistics(&(ptTopicState->tStatistics), tError, sizLength);
+		if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			ptTopicState->tStatistics.fHasAcked = true;
+			ptTopicState->tStatistics.uiLastAckedSequenceNr = uiSequenceNr;
+		}
+
+		/* Record the time from "send" to the delivery report. librdkafka
+		 * measures it from the enqueue time of the message.
+		 */
+		if( tError==RD_KAFKA_RESP_ERR_NO_ERROR && llLatency>=0 )
+		{
+			if( ptTopicState->ptLatency==NULL )
+			{
+				ptTopicState->ptLatency = (KAFKA_LATENCY_HISTOGRAM_T*)calloc(1, sizeof(KAFKA_LATENCY_HISTOGRAM_T));
+			}
+			if( ptTopicState->ptLatency!=NULL )
+			{
+				kafka_latency_record(ptTopicState->ptLatency, (uint64_t)llLatency);
+			}
+		}
+	}
+
+	/* Collect the complete report for poll_reports and the LUA callbacks. */
+	if( m_fCollectReports==true || m_iDeliveryCallback!=LUA_NOREF || m_uiTopicCallbacks!=0 )
+	{
+		addReport(false, ptTopicState, uiSequenceNr, tError, iPartition, llOffset);
+	}
+	/* Keep a failure for the next poll_reports if it arrived somewhere
+	 * else. This is only necessary if poll_reports is used at all.
+	 */
+	if( m_fCollectReports==false && m_fReportsPolled==true && tError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		addReport(true, ptTopicState, uiSequenceNr, tError, iPartition, llOffset);
+	}
+
+	/* Remember the result for the next poll. */
+	m_pvMsgOpaque = (void*)uiSequenceNr;
+	if( tError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		++m_uiFailures;
+	}
+
+	/* Printing each message is expensive. Do this only on request. */
+	if( m_fVerbose==true )
+	{
+		pcTopic = "?";
+		if( ptTopicState!=NULL )
+		{
+			pcTopic = ptTopicState->pcName;
+		}
+		if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			printf("RdKafkaCore(%p): Message %s/%" PRIuPTR " delivered.\n", this, pcTopic, uiSequenceNr);
+		}
+		else
+		{
+			printf("RdKafkaCore(%p): Failed to deliver message %s/%" PRIuPTR ": %s\n", this, pcTopic, uiSequenceNr, rd_kafka_err2str(tError));
+		}
+	}
+
+	/* The message is done. Release the opaque and the LUA string. */
+	if( ptOpaque!=NULL )
+	{
+		releaseMessageOpaque(ptOpaque);
+	}
+}
+
+
+
+void RdKafkaCore::errorCallbackStatic(rd_kafka_t *ptRk, int iErr, const char *pcReason, void *pvOpaque)
+{
+	RdKafkaCore *ptThis;
+
+
+	ptThis = (RdKafkaCore*)pvOpaque;
+	ptThis->errorCallback(ptRk, iErr, pcReason);
+}
+
+
+
+/* librdkafka recovers from most errors by itself. A fatal error stops the
+ * handle, for example a fenced transactional producer or a broken
+ * idempotence sequence. In this case the reason is only a generic text, the
+ * real error comes from rd_kafka_fatal_error.
+ */
+void RdKafkaCore::errorCallback(rd_kafka_t *ptRk, int iErr, const char *pcReason)
+{
+	rd_kafka_resp_err_t tFatalError;
+	char acReason[512];
+
+
+	if( iErr==RD_KAFKA_RESP_ERR__FATAL )
+	{
+		tFatalError = rd_kafka_fatal_error(ptRk, acReason, sizeof(acReason));
+		__atomic_store_n(&m_iFatalError, 1, __ATOMIC_RELEASE);
+		fprintf(stderr, "RdKafkaCore(%p): rdkafka fatal error %d (%s): %s\n", this, tFatalError, rd_kafka_err2name(tFatalError), acReason);
+	}
+	else
+	{
+		fprintf(stderr, "RdKafkaCore(%p): rdkafka error %d: %s\n", this, iErr, pcReason);
+	}
+}
+
+
+
+int RdKafkaCore::statsCallbackStatic(rd_kafka_t *ptRk, char *pcJson, size_t sizJson, void *pvOpaque)
+{
+	RdKafkaCore *ptThis;
+
+
+	ptThis = (RdKafkaCore*)pvOpaque;
+	return ptThis->statsCallback(pcJson, sizJson);
+}
+
+
+
+/* Keep a copy of the latest statistics. This can run in the background
+ * thread. An older document which was not picked up by the LUA thread yet
+ * is replaced.
+ */
+int RdKafkaCore::statsCallback(char *pcJson, size_t sizJson)
+{
+	char *pcCopy;
+	char *pcOld;
+
+
+	pcCopy = (char*)malloc(sizJson + 1);
+	if( pcCopy!=NULL )
+	{
+		memcpy(pcCopy, pcJson, sizJson);
+		pcCopy[sizJson] = 0;
+		pcOld = __atomic_exchange_n(&m_pcStatisticsPending, pcCopy, __ATOMIC_ACQ_REL);
+		if( pcOld!=NULL )
+		{
+			free(pcOld);
+		}
+	}
+
+	/* librdkafka frees the JSON document. */
+	return 0;
+}
+
+
+
+rd_kafka_t *RdKafkaCore::_getRk(void)
+{
+	return m_ptRk;
+}
+
+
+
+rd_kafka_type_t RdKafkaCore::getType(void)
+{
+	return m_tType;
+}
+
+
+
+KAFKA_MESSAGE_OPAQUE_T *RdKafkaCore::allocateMessageOpaque(KAFKA_TOPIC_STATE_T *ptTopicState, uintptr_t uiSequenceNr)
+{
+	KAFKA_MESSAGE_OPAQUE_T *ptOpaque;
+
+
+	/* Reuse an old opaque if possible. */
+	ptOpaque = m_ptFreeMessageOpaques;
+	if( ptOpaque!=NULL )
+	{
+		m_ptFreeMessageOpaques = ptOpaque->ptNext;
+	}
+	else
+	{
+		ptOpaque = (KAFKA_MESSAGE_OPAQUE_T*)malloc(sizeof(KAFKA_MESSAGE_OPAQUE_T));
+	}
+
+	if( ptOpaque!=NULL )
+	{
+		ptOpaque->ptNext = NULL;
+		ptOpaque->ptTopicState = ptTopicState;
+		ptOpaque->uiSequenceNr = uiSequenceNr;
+		ptOpaque->ptLuaState = NULL;
+		ptOpaque->iLuaReference = LUA_NOREF;
+	}
+
+	return ptOpaque;
+}
+
+
+
+void RdKafkaCore::releaseMessageOpaque(KAFKA_MESSAGE_OPAQUE_T *ptOpaque)
+{
+	/* Release an anchored LUA string. */
+	if( ptOpaque->iLuaReference!=LUA_NOREF )
+	{
+		luaL_unref(ptOpaque->ptLuaState, LUA_REGISTRYINDEX, ptOpaque->iLuaReference);
+		ptOpaque->iLuaReference = LUA_NOREF;
+		ptOpaque->ptLuaState = NULL;
+	}
+
+	/* Add the opaque to the list of free entries. */
+	ptOpaque->ptNext = m_ptFreeMessageOpaques;
+	m_ptFreeMessageOpaques = ptOpaque;
+}
+
+
+
+/* Get the state for a topic name. Create a new one if the name is not known
+ * yet.
+ */
+KAFKA_TOPIC_STATE_T *RdKafkaCore::getTopicState(const char *pcTopic)
+{
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+
+
+	ptTopicState = m_ptTopicStates;
+	while( ptTopicState!=NULL )
+	{
+		if( strcmp(ptTopicState->pcName, pcTopic)==0 )
+		{
+			break;
+		}
+		ptTopicState = ptTopicState->ptNext;
+	}
+
+	if( ptTopicState==NULL )
+	{
+		ptTopicState = (KAFKA_TOPIC_STATE_T*)malloc(sizeof(KAFKA_TOPIC_STATE_T));
+		if( ptTopicState!=NULL )
+		{
+			memset(ptTopicState, 0, sizeof(KAFKA_TOPIC_STATE_T));
+			ptTopicState->pcName = strdup(pcTopic);
+			ptTopicState->iDeliveryCallback = LUA_NOREF;
+			ptTopicState->ptNext = m_ptTopicStates;
+			m_ptTopicStates = ptTopicState;
+		}
+	}
+
+	return ptTopicState;
+}
+
+
+
+/* Find the librdkafka handle of a topic with the config key from
+ * kafka_push_config_key. This returns NULL if there is no such handle yet.
+ */
+rd_kafka_topic_t *RdKafkaCore::getTopicHandle(KAFKA_TOPIC_STATE_T *ptTopicState, const char *pcConfigKey)
+{
+	KAFKA_TOPIC_HANDLE_T *ptHandle;
+	rd_kafka_topic_t *ptTopic;
+
+
+	ptTopic = NULL;
+	ptHandle = ptTopicState->ptHandles;
+	while( ptHandle!=NULL )
+	{
+		if( strcmp(ptHandle->pcConfigKey, pcConfigKey)==0 )
+		{
+			ptTopic = ptHandle->ptTopic;
+			break;
+		}
+		ptHandle = ptHandle->ptNext;
+	}
+
+	return ptTopic;
+}
+
+
+
+/* Keep a new topic handle. The core destroys it with the handle. This
+ * returns false if there is not enough memory.
+ */
+bool RdKafkaCore::addTopicHandle(KAFKA_TOPIC_STATE_T *ptTopicState, const char *pcConfigKey, rd_kafka_topic_t *ptTopic)
+{
+	KAFKA_TOPIC_HANDLE_T *ptHandle;
+	bool fResult;
+
+
+	fResult = false;
+	ptHandle = (KAFKA_TOPIC_HANDLE_T*)malloc(sizeof(KAFKA_TOPIC_HANDLE_T));
+	if( ptHandle!=NULL )
+	{
+		ptHandle->pcConfigKey = strdup(pcConfigKey);
+		if( ptHandle->pcConfigKey==NULL )
+		{
+			free(ptHandle);
+		}
+		else
+		{
+			ptHandle->ptTopic = ptTopic;
+			ptHandle->ptNext = ptTopicState->ptHandles;
+			ptTopicState->ptHandles = ptHandle;
+			fResult = true;
+		}
+	}
+
+	return fResult;
+}
+
+
+
+const KAFKA_DELIVERY_STATISTICS_T *RdKafkaCore::getDeliveryStatistics(void)
+{
+	return &m_tStatistics;
+}
+
+
+
+void RdKafkaCore::setShard(unsigned int uiShard)
+{
+	m_uiShard = uiShard;
+}
+
+
+
+void RdKafkaCore::setVerbose(bool fVerbose)
+{
+	m_fVerbose = fVerbose;
+}
+
+
+
+bool RdKafkaCore::getVerbose(void)
+{
+	return m_fVerbose;
+}
+
+
+
+/* Poll the core and pass the reports to the LUA callbacks. Return the
+ * number of served events.
+ */
+int RdKafkaCore::poll(lua_State *ptLuaState, int iTimeout, void **ppvMsgOpaque, unsigned int *puiFailures)
+{
+	int iEvents;
+	int iResult;
+
+
+	if( m_fInDeliveryCallback==true )
+	{
+		luaL_error(ptLuaState, "Polling is not allowed in a delivery callback.");
+	}
+
+	m_pvMsgOpaque = NULL;
+	m_uiFailures = 0;
+
+	drainEventFd();
+	if( m_fBackgroundPoll==true )
+	{
+		iEvents = (int)waitForReports(iTimeout);
+	}
+	else
+	{
+		iEvents = rd_kafka_poll(m_ptRk, iTimeout);
+	}
+
+	*ppvMsgOpaque = m_pvMsgOpaque;
+	*puiFailures = m_uiFailures;
+
+	/* Pass all collected reports to the LUA callbacks. */
+	iResult = callDeliveryCallbacks(ptLuaState);
+	m_sizReports = 0;
+	if( iResult!=0 )
+	{
+		/* Pass the error of the callback to the caller. */
+		lua_error(ptLuaState);
+	}
+
+	return iEvents;
+}
+
+
+
+/* Set or clear a LUA delivery callback. The function is at the stack index
+ * iIndex. An index of 0, a nil value or a NULL state removes the callback.
+ * The callback is for all messages if ptTopicState is NULL. Otherwise it is
+ * only for messages of this topic.
+ */
+void RdKafkaCore::setDeliveryCallback(lua_State *ptLuaState, int iIndex, KAFKA_TOPIC_STATE_T *ptTopicState)
+{
+	int iType;
+	int *piReference;
+	lua_State *ptMainState;
+
+
+	iType = LUA_TNIL;
+	if( ptLuaState!=NULL && iIndex!=0 )
+	{
+		iType = lua_type(ptLuaState, iIndex);
+	}
+	if( iType!=LUA_TNIL && iType!=LUA_TFUNCTION )
+	{
+		luaL_error(ptLuaState, "The delivery callback must be a function or nil.");
+	}
+
+	if( ptTopicState==NULL )
+	{
+		piReference = &m_iDeliveryCallback;
+	}
+	else
+	{
+		piReference = &(ptTopicState->iDeliveryCallback);
+		++ptTopicState->uiDeliveryCallbackGeneration;
+	}
+
+	/* Remove an old callback. */
+	if( *piReference!=LUA_NOREF )
+	{
+		luaL_unref(m_ptCallbackLuaState, LUA_REGISTRYINDEX, *piReference);
+		*piReference = LUA_NOREF;
+		if( ptTopicState!=NULL )
+		{
+			--m_uiTopicCallbacks;
+		}
+	}
+
+	if( iType==LUA_TFUNCTION )
+	{
+		/* Keep the main thread to release the callback in the destructor. */
+#if LUA_VERSION_NUM>=502
+		lua_rawgeti(ptLuaState, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+		ptMainState = lua_tothread(ptLuaState, -1);
+		lua_pop(ptLuaState, 1);
+#else
+		ptMainState = ptLuaState;
+#endif
+		m_ptCallbackLuaState = ptMainState;
+
+		lua_pushvalue(ptLuaState, iIndex);
+		*piReference = luaL_ref(ptLuaState, LUA_REGISTRYINDEX);
+		if( ptTopicState!=NULL )
+		{
+			++m_uiTopicCallbacks;
+		}
+	}
+}
+
+
+
+/* Append a report to the buffer for the current poll or to the pending
+ * reports if fPendingReport is true. Both buffers grow on demand. The
+ * pending reports stop at KAFKA_PENDING_REPORTS_MAX entries.
+ */
+void RdKafkaCore::addReport(bool fPendingReport, KAFKA_TOPIC_STATE_T *ptTopicState, uintptr_t uiSequenceNr, rd_kafka_resp_err_t tError, int32_t iPartition, int64_t llOffset)
+{
+	KAFKA_DELIVERY_REPORT_T **pptReports;
+	size_t *psizReports;
+	size_t *psizReportsMax;
+	size_t sizNewMax;
+	KAFKA_DELIVERY_REPORT_T *ptNewReports;
+	KAFKA_DELIVERY_REPORT_T *ptReport;
+
+
+	if( fPendingReport==true )
+	{
+		pptReports = &m_ptPendingReports;
+		psizReports = &m_sizPendingReports;
+		psizReportsMax = &m_sizPendingReportsMax;
+	}
+	else
+	{
+		pptReports = &m_ptReports;
+		psizReports = &m_sizReports;
+		psizReportsMax = &m_sizReportsMax;
+	}
+
+	/* Grow the buffer if it is full. */
+	if( *psizReports>=*psizReportsMax && (fPendingReport==false || *psizReportsMax<KAFKA_PENDING_REPORTS_MAX) )
+	{
+		sizNewMax = *psizReportsMax * 2;
+		if( sizNewMax==0 )
+		{
+			sizNewMax = 256;
+		}
+		ptNewReports = (KAFKA_DELIVERY_REPORT_T*)realloc(*pptReports, sizNewMax*sizeof(KAFKA_DELIVERY_REPORT_T));
+		if( ptNewReports!=NULL )
+		{
+			*pptReports = ptNewReports;
+			*psizReportsMax = sizNewMax;
+		}
+	}
+
+	if( *psizReports<*psizReportsMax )
+	{
+		ptReport = *pptReports + *psizReports;
+		ptReport->ptTopicState = ptTopicState;
+		ptReport->uiSequenceNr = uiSequenceNr;
+		ptReport->tError = tError;
+		ptReport->iPartition = iPartition;
+		ptReport->llOffset = llOffset;
+		++(*psizReports);
+	}
+	else
+	{
+		++m_ulReportsLost;
+	}
+}
+
+
+
+/* Push a table with the collected delivery reports. Only reports of one
+ * topic are used if ptTopicState is not NULL. The pending reports are
+ * added before the collected reports if fPendingReports is true.
+ */
+void RdKafkaCore::pushReports(lua_State *ptLuaState, KAFKA_TOPIC_STATE_T *ptTopicState, bool fPendingReports)
+{
+	KAFKA_DELIVERY_REPORT_T *ptCnt;
+	KAFKA_DELIVERY_REPORT_T *ptEnd;
+	int iIndex;
+	unsigned int uiPass;
+
+
+	lua_createtable(ptLuaState, (ptTopicState==NULL) ? (int)(m_sizReports + ((fPendingReports==true) ? m_sizPendingReports : 0)) : 0, 0);
+	iIndex = 1;
+	for(uiPass=0; uiPass<2; ++uiPass)
+	{
+		if( uiPass==0 )
+		{
+			ptCnt = m_ptPendingReports;
+			ptEnd = m_ptPendingReports;
+			if( fPendingReports==true )
+			{
+				ptEnd = m_ptPendingReports + m_sizPendingReports;
+			}
+		}
+		else
+		{
+			ptCnt = m_ptReports;
+			ptEnd = m_ptReports + m_sizReports;
+		}
+		while( ptCnt<ptEnd )
+		{
+			if( ptTopicState==NULL || ptTopicState==ptCnt->ptTopicState )
+			{
+				lua_createtable(ptLuaState, 0, 6);
+				if( ptCnt->ptTopicState!=NULL )
+				{
+					lua_pushstring(ptLuaState, ptCnt->ptTopicState->pcName);
+					lua_setfield(ptLuaState, -2, "topic");
+				}
+				if( m_uiShard!=0 )
+				{
+#if LUA_VERSION_NUM>=504
+					lua_pushinteger(ptLuaState, m_uiShard);
+#else
+					lua_pushnumber(ptLuaState, m_uiShard);
+#endif
+					lua_setfield(ptLuaState, -2, "shard");
+				}
+#if LUA_VERSION_NUM>=504
+				lua_pushinteger(ptLuaState, (lua_Integer)ptCnt->uiSequenceNr);
+				lua_setfield(ptLuaState, -2, "sequence");
+				lua_pushinteger(ptLuaState, ptCnt->tError);
+				lua_setfield(ptLuaState, -2, "error");
+				lua_pushinteger(ptLuaState, ptCnt->iPartition);
+				lua_setfield(ptLuaState, -2, "partition");
+				lua_pushinteger(ptLuaState, (lua_Integer)ptCnt->llOffset);
+				lua_setfield(ptLuaState, -2, "offset");
+#else
+				lua_pushnumber(ptLuaState, (lua_Number)ptCnt->uiSequenceNr);
+				lua_setfield(ptLuaState, -2, "sequence");
+				lua_pushnumber(ptLuaState, ptCnt->tError);
+				lua_setfield(ptLuaState, -2, "error");
+				lua_pushnumber(ptLuaState, ptCnt->iPartition);
+				lua_setfield(ptLuaState, -2, "partition");
+				lua_pushnumber(ptLuaState, (lua_Number)ptCnt->llOffset);
+				lua_setfield(ptLuaState, -2, "offset");
+#endif
+				lua_rawseti(ptLuaState, -2, iIndex);
+				++iIndex;
+			}
+
+			++ptCnt;
+		}
+	}
+}
+
+
+
+/* Pass the collected delivery reports to the LUA callbacks. Each callback is
+ * called once with a table of all its reports.
+ * This returns 0 on success. If a callback failed, the error is on the top
+ * of the stack and the function returns 1.
+ */
+int RdKafkaCore::callDeliveryCallbacks(lua_State *ptLuaState)
+{
+	int iResult;
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+	size_t sizReports;
+
+
+	iResult = 0;
+	if( m_sizReports!=0 )
+	{
+		m_fInDeliveryCallback = true;
+
+		/* The callback for all messages gets all reports. */
+		if( m_iDeliveryCallback!=LUA_NOREF )
+		{
+			lua_rawgeti(ptLuaState, LUA_REGISTRYINDEX, m_iDeliveryCallback);
+			pushReports(ptLuaState, NULL, false);
+			iResult = lua_pcall(ptLuaState, 1, 0, 0);
+		}
+
+		/* The topic callbacks get only the reports for their topic. */
+		ptTopicState = m_ptTopicStates;
+		while( iResult==0 && m_uiTopicCallbacks!=0 && ptTopicState!=NULL )
+		{
+			if( ptTopicState->iDeliveryCallback!=LUA_NOREF )
+			{
+				lua_rawgeti(ptLuaState, LUA_REGISTRYINDEX, ptTopicState->iDeliveryCallback);
+				pushReports(ptLuaState, ptTopicState, false);
+#if LUA_VERSION_NUM>=502
+				sizReports = lua_rawlen(ptLuaState, -1);
+#else
+				sizReports = lua_objlen(ptLuaState, -1);
+#endif
+				if( sizReports==0 )
+				{
+					/* Do not call the function without reports. */
+					lua_pop(ptLuaState, 2);
+				}
+				else
+				{
+					iResult = lua_pcall(ptLuaState, 1, 0, 0);
+				}
+			}
+			ptTopicState = ptTopicState->ptNext;
+		}
+
+		m_fInDeliveryCallback = false;
+	}
+
+	if( iResult!=0 )
+	{
+		iResult = 1;
+	}
+	return iResult;
+}
+
+
+
+/* Remove the reports which were returned by a poll_reports from the pending
+ * buffer. All reports were returned if ptTopicState is NULL. Otherwise the
+ * reports of the other topics are kept, and the collected reports of the
+ * other topics are added for their next poll_reports.
+ */
+void RdKafkaCore::keepPendingReports(KAFKA_TOPIC_STATE_T *ptTopicState)
+{
+	size_t sizCnt;
+	size_t sizKept;
+	KAFKA_DELIVERY_REPORT_T *ptReport;
+
+
+	if( ptTopicState==NULL )
+	{
+		m_sizPendingReports = 0;
+	}
+	else
+	{
+		sizKept = 0;
+		for(sizCnt=0; sizCnt<m_sizPendingReports; ++sizCnt)
+		{
+			if( m_ptPendingReports[sizCnt].ptTopicState!=ptTopicState )
+			{
+				m_ptPendingReports[sizKept] = m_ptPendingReports[sizCnt];
+				++sizKept;
+			}
+		}
+		m_sizPendingReports = sizKept;
+
+		for(sizCnt=0; sizCnt<m_sizReports; ++sizCnt)
+		{
+			ptReport = m_ptReports + sizCnt;
+			if( ptReport->ptTopicState!=ptTopicState )
+			{
+				addReport(true, ptReport->ptTopicState, ptReport->uiSequenceNr, ptReport->tError, ptReport->iPartition, ptReport->llOffset);
+			}
+		}
+	}
+}
+
+
+
+/* Poll the producer and return the delivery reports in one table. Each
+ * entry has the fields "topic", "sequence", "error", "partition" and
+ * "offset". Only the reports of one topic are returned if ptTopicState is
+ * not NULL. The reports of the other topics are kept for the next
+ * poll_reports.
+ */
+void RdKafkaCore::pollReports(lua_State *ptLuaState, int iTimeout, KAFKA_TOPIC_STATE_T *ptTopicState)
+{
+	int iResult;
+
+
+	if( m_fInDeliveryCallback==true )
+	{
+		luaL_error(ptLuaState, "Polling is not allowed in a delivery callback.");
+	}
+
+	m_pvMsgOpaque = NULL;
+	m_uiFailures = 0;
+
+	drainEventFd();
+	m_fReportsPolled = true;
+	m_fCollectReports = true;
+	if( m_fBackgroundPoll==true )
+	{
+		waitForReports(iTimeout);
+	}
+	else
+	{
+		rd_kafka_poll(m_ptRk, iTimeout);
+	}
+	m_fCollectReports = false;
+
+	pushReports(ptLuaState, ptTopicState, true);
+	keepPendingReports(ptTopicState);
+
+	if( m_ulReportsLost!=0 )
+	{
+		fprintf(stderr, "RdKafkaCore(%p): %lu delivery reports lost, the buffer is full or failed to grow.\n", this, m_ulReportsLost);
+		m_ulReportsLost = 0;
+	}
+
+	/* Pass the reports to the LUA callbacks too. The pending reports were
+	 * already passed to them.
+	 */
+	iResult = callDeliveryCallbacks(ptLuaState);
+
+	/* Keep the buffer for the next poll. */
+	m_sizReports = 0;
+
+	if( iResult!=0 )
+	{
+		lua_error(ptLuaState);
+	}
+}
+
+
+
+int RdKafkaCore::flush(int iTimeout)
+{
+	rd_kafka_resp_err_t tResult;
+	int iResult;
+	uint64_t ullStart;
+
+
+	if( m_fBackgroundPoll==true )
+	{
+		/* rd_kafka_flush would call the delivery callback in this thread.
+		 * Wait for the background thread instead. A negative timeout waits
+		 * forever like rd_kafka_flush.
+		 */
+		ullStart = kafka_get_time_ms();
+		while( rd_kafka_outq_len(m_ptRk)>0 && (iTimeout<0 || (kafka_get_time_ms()-ullStart)<(uint64_t)iTimeout) )
+		{
+			drainRing();
+			kafka_sleep_ms(1);
+		}
+		drainRing();
+
+		tResult = RD_KAFKA_RESP_ERR_NO_ERROR;
+		if( rd_kafka_outq_len(m_ptRk)>0 )
+		{
+			tResult = RD_KAFKA_RESP_ERR__TIMED_OUT;
+		}
+	}
+	else
+	{
+		tResult = rd_kafka_flush(m_ptRk, iTimeout);
+	}
+	iResult = (int)(tResult);
+	return iResult;
+}
+
+
+
+/* Start a native thread which polls the handle. The delivery reports are
+ * passed to the LUA thread in a ring with at least uiRingSize entries.
+ */
+int RdKafkaCore::startBackgroundPoll(unsigned int uiRingSize)
+{
+	rd_kafka_resp_err_t tResult;
+	size_t sizRing;
+	int iResult;
+
+
+	tResult = RD_KAFKA_RESP_ERR_NO_ERROR;
+	if( m_tType!=RD_KAFKA_PRODUCER || uiRingSize==0 )
+	{
+		tResult = RD_KAFKA_RESP_ERR__INVALID_ARG;
+	}
+	else if( m_fBackgroundPoll==true )
+	{
+		tResult = RD_KAFKA_RESP_ERR__STATE;
+	}
+	else
+	{
+		/* The size of the ring must be a power of 2. */
+		sizRing = 1;
+		while( sizRing<uiRingSize )
+		{
+			sizRing <<= 1;
+		}
+
+		/* Keep the old ring if it has the same size. */
+		if( m_ptRing!=NULL && (m_sizRingMask+1)!=sizRing )
+		{
+			free(m_ptRing);
+			m_ptRing = NULL;
+		}
+		if( m_ptRing==NULL )
+		{
+			m_ptRing = (KAFKA_RING_ENTRY_T*)malloc(sizRing * sizeof(KAFKA_RING_ENTRY_T));
+		}
+		if( m_ptRing==NULL )
+		{
+			tResult = RD_KAFKA_RESP_ERR__FAIL;
+		}
+		else
+		{
+			m_sizRingMask = sizRing - 1;
+			m_sizRingHead = 0;
+			m_sizRingTail = 0;
+			m_iBackgroundStop = 0;
+			m_iBackgroundFinished = 0;
+
+			/* Process all reports which are waiting in the handle before
+			 * the background thread takes over.
+			 */
+			rd_kafka_poll(m_ptRk, 0);
+
+			__atomic_store_n(&m_fBackgroundPoll, true, __ATOMIC_RELEASE);
+#if defined(_WIN32)
+			m_tBackgroundThread = CreateThread(NULL, 0, kafka_background_thread, this, 0, NULL);
+			iResult = (m_tBackgroundThread==NULL) ? -1 : 0;
+#else
+			iResult = pthread_create(&m_tBackgroundThread, NULL, kafka_background_thread, this);
+#endif
+			if( iResult!=0 )
+			{
+				__atomic_store_n(&m_fBackgroundPoll, false, __ATOMIC_RELEASE);
+				tResult = RD_KAFKA_RESP_ERR__FAIL;
+			}
+		}
+	}
+
+	iResult = (int)(tResult);
+	return iResult;
+}
+
+
+
+/* Stop the background thread and process all reports from the ring. */
+void RdKafkaCore::stopBackgroundPoll(void)
+{
+	if( m_fBackgroundPoll==true )
+	{
+		__atomic_store_n(&m_iBackgroundStop, 1, __ATOMIC_RELEASE);
+
+		/* The thread might wait for free space in the ring. */
+		while( __atomic_load_n(&m_iBackgroundFinished, __ATOMIC_ACQUIRE)==0 )
+		{
+			drainRing();
+			kafka_sleep_ms(1);
+		}
+
+#if defined(_WIN32)
+		WaitForSingleObject(m_tBackgroundThread, INFINITE);
+		CloseHandle(m_tBackgroundThread);
+#else
+		pthread_join(m_tBackgroundThread, NULL);
+#endif
+		drainRing();
+		__atomic_store_n(&m_fBackgroundPoll, false, __ATOMIC_RELEASE);
+	}
+}
+
+
+
+/* Stop the background thread for a call which serves the delivery callback
+ * in the LUA thread, like a flush inside librdkafka. This returns true if
+ * the thread was running. Pass the result to resumeBackgroundPoll.
+ */
+bool RdKafkaCore::pauseBackgroundPoll(void)
+{
+	bool fWasRunning;
+
+
+	fWasRunning = m_fBackgroundPoll;
+	stopBackgroundPoll();
+
+	return fWasRunning;
+}
+
+
+
+/* Start the background thread again after pauseBackgroundPoll. The ring
+ * keeps its size.
+ */
+void RdKafkaCore::resumeBackgroundPoll(void)
+{
+	int iResult;
+
+
+	iResult = startBackgroundPoll((unsigned int)(m_sizRingMask + 1));
+	if( iResult!=RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		fprintf(stderr, "RdKafkaCore(%p): failed to restart the background poll: %s\n", this, rd_kafka_err2str((rd_kafka_resp_err_t)iResult));
+	}
+}
+
+
+
+/* This runs in the background thread. */
+void RdKafkaCore::backgroundPoll(void)
+{
+	int iEvents;
+#if !defined(_WIN32)
+	int iFd;
+	ssize_t ssizResult;
+#endif
+
+
+	while( __atomic_load_n(&m_iBackgroundStop, __ATOMIC_ACQUIRE)==0 )
+	{
+		iEvents = rd_kafka_poll(m_ptRk, 100);
+#if !defined(_WIN32)
+		/* Wake up the LUA event loop, there are new reports in the ring. */
+		iFd = __atomic_load_n(&(m_aiEventPipe[1]), __ATOMIC_ACQUIRE);
+		if( iEvents>0 && iFd!=-1 )
+		{
+			ssizResult = write(iFd, "1", 1);
+			(void)ssizResult;
+		}
+#else
+		(void)iEvents;
+#endif
+	}
+	__atomic_store_n(&m_iBackgroundFinished, 1, __ATOMIC_RELEASE);
+}
+
+
+
+/* Get a file descriptor which becomes readable if events are waiting in the
+ * main queue of a producer or the consumer queue of a consumer. The pipe is
+ * created on the first call. This returns -1 on error.
+ * Note that librdkafka only writes to the pipe if a queue was empty before.
+ * After a wakeup the queue should be polled until it is empty.
+ */
+int RdKafkaCore::getEventFd(void)
+{
+#if defined(_WIN32)
+	/* librdkafka expects a socket on windows. This is not supported yet. */
+	return -1;
+#else
+	int aiPipe[2];
+	int iResult;
+
+
+	if( m_aiEventPipe[0]==-1 )
+	{
+		iResult = pipe(aiPipe);
+		if( iResult==0 )
+		{
+			/* Neither librdkafka nor the drain may block on the pipe. */
+			fcntl(aiPipe[0], F_SETFL, fcntl(aiPipe[0], F_GETFL) | O_NONBLOCK);
+			fcntl(aiPipe[1], F_SETFL, fcntl(aiPipe[1], F_GETFL) | O_NONBLOCK);
+			m_aiEventPipe[0] = aiPipe[0];
+			__atomic_store_n(&(m_aiEventPipe[1]), aiPipe[1], __ATOMIC_RELEASE);
+
+			if( m_tType==RD_KAFKA_CONSUMER )
+			{
+				m_ptEventQueue = rd_kafka_queue_get_consumer(m_ptRk);
+			}
+			else
+			{
+				m_ptEventQueue = rd_kafka_queue_get_main(m_ptRk);
+			}
+			enableQueueEvents(m_ptEventQueue);
+		}
+	}
+
+	return m_aiEventPipe[0];
+#endif
+}
+
+
+
+/* Write to the event pipe if events arrive in the queue. The caller must
+ * disable this again before the queue is destroyed.
+ */
+void RdKafkaCore::enableQueueEvents(rd_kafka_queue_t *ptQueue)
+{
+	if( ptQueue!=NULL && m_aiEventPipe[1]!=-1 )
+	{
+		rd_kafka_queue_io_event_enable(ptQueue, m_aiEventPipe[1], "1", 1);
+	}
+}
+
+
+
+/* Push the latest statistics as a LUA table with the most important values.
+ * This pushes nil if there are no statistics yet.
+ */
+void RdKafkaCore::pushStatistics(lua_State *ptLuaState)
+{
+	KAFKA_JSON_PARSER_T tParser;
+	int iResult;
+
+
+	/* Push the document as a string first. */
+	pushStatisticsJson(ptLuaState);
+	if( lua_type(ptLuaState, -1)==LUA_TSTRING )
+	{
+		tParser.pcCnt = m_pcStatistics;
+		tParser.pcEnd = m_pcStatistics + strlen(m_pcStatistics);
+		tParser.uiDepth = 0;
+		iResult = kafka_json_push_value(ptLuaState, &tParser);
+		if( iResult!=0 || lua_type(ptLuaState, -1)!=LUA_TTABLE )
+		{
+			if( iResult==0 )
+			{
+				lua_pop(ptLuaState, 1);
+			}
+			fprintf(stderr, "RdKafkaCore(%p): failed to parse the statistics.\n", this);
+			lua_pop(ptLuaState, 1);
+			lua_pushnil(ptLuaState);
+		}
+		else
+		{
+			kafka_push_statistics_summary(ptLuaState, lua_gettop(ptLuaState));
+
+			/* Keep only the summary on the stack. */
+			lua_replace(ptLuaState, -3);
+			lua_pop(ptLuaState, 1);
+		}
+	}
+}
+
+
+
+/* Push the latest statistics as a JSON string or nil. */
+void RdKafkaCore::pushStatisticsJson(lua_State *ptLuaState)
+{
+	char *pcNew;
+
+
+	/* Get a new document from the statistics callback. */
+	pcNew = __atomic_exchange_n(&m_pcStatisticsPending, (char*)NULL, __ATOMIC_ACQ_REL);
+	if( pcNew!=NULL )
+	{
+		if( m_pcStatistics!=NULL )
+		{
+			free(m_pcStatistics);
+		}
+		m_pcStatistics = pcNew;
+	}
+
+	if( m_pcStatistics==NULL )
+	{
+		lua_pushnil(ptLuaState);
+	}
+	else
+	{
+		lua_pushstring(ptLuaState, m_pcStatistics);
+	}
+}
+
+
+
+/* Process delivery reports for up to iTimeout milliseconds to make room in
+ * the local queue. The LUA callbacks are not called here, the reports are
+ * passed to them with the next poll.
+ * This returns false if waiting is not possible. Waiting makes no sense
+ * after a fatal error as the queue will never accept messages again.
+ */
+bool RdKafkaCore::serviceQueue(int iTimeout)
+{
+	bool fResult;
+
+
+	fResult = false;
+	if( m_fInDeliveryCallback==false && hasFatalError()==false )
+	{
+		if( m_fBackgroundPoll==true )
+		{
+			waitForReports(iTimeout);
+		}
+		else
+		{
+			rd_kafka_poll(m_ptRk, iTimeout);
+		}
+		fResult = true;
+	}
+
+	return fResult;
+}
+
+
+
+void RdKafkaCore::getQueueStatus(int *piLength, unsigned int *puiMaxMessages, unsigned int *puiMaxKBytes)
+{
+	*piLength = rd_kafka_outq_len(m_ptRk);
+	*puiMaxMessages = m_uiQueueMaxMessages;
+	*puiMaxKBytes = m_uiQueueMaxKBytes;
+}
+
+
+
+/* Request the metadata of all topics with a handle in this core and keep
+ * them for "pushMetadata". librdkafka also fills its own cache with the
+ * result, so the first message to a topic does not wait for the metadata.
+ */
+int RdKafkaCore::refreshMetadata(int iTimeout)
+{
+	const struct rd_kafka_metadata *ptMetadata;
+	rd_kafka_resp_err_t tError;
+
+
+	tError = rd_kafka_metadata(m_ptRk, 0, NULL, &ptMetadata, iTimeout);
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		if( m_ptMetadata!=NULL )
+		{
+			rd_kafka_metadata_destroy(m_ptMetadata);
+		}
+		m_ptMetadata = ptMetadata;
+		m_ullMetadataTime = kafka_get_time_ms();
+	}
+
+	return (int)tError;
+}
+
+
+
+/* Create a topic handle for each name in the array at iTableIndex. This
+ * makes the topics known to librdkafka. Then request the metadata for all
+ * of them with one request.
+ */
+int RdKafkaCore::prefetchMetadata(lua_State *ptLuaState, int iTableIndex, int iTimeout)
+{
+	size_t sizTopics;
+	size_t sizCnt;
+	const char *pcTopic;
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+	rd_kafka_topic_t *ptTopic;
+	rd_kafka_resp_err_t tError;
+
+
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+#if LUA_VERSION_NUM>=502
+	sizTopics = lua_rawlen(ptLuaState, iTableIndex);
+#else
+	sizTopics = lua_objlen(ptLuaState, iTableIndex);
+#endif
+	for(sizCnt=1; sizCnt<=sizTopics; ++sizCnt)
+	{
+		lua_rawgeti(ptLuaState, iTableIndex, (int)sizCnt);
+		pcTopic = lua_tostring(ptLuaState, -1);
+		if( pcTopic==NULL )
+		{
+			tError = RD_KAFKA_RESP_ERR__INVALID_ARG;
+		}
+		else
+		{
+			/* Use the same handle as a Topic without config. */
+			ptTopicState = getTopicState(pcTopic);
+			if( ptTopicState==NULL )
+			{
+				tError = RD_KAFKA_RESP_ERR__FAIL;
+			}
+			else if( getTopicHandle(ptTopicState, "")==NULL )
+			{
+				ptTopic = rd_kafka_topic_new(m_ptRk, pcTopic, NULL);
+				if( ptTopic==NULL )
+				{
+					tError = rd_kafka_last_error();
+				}
+				else if( addTopicHandle(ptTopicState, "", ptTopic)!=true )
+				{
+					rd_kafka_topic_destroy(ptTopic);
+					tError = RD_KAFKA_RESP_ERR__FAIL;
+				}
+			}
+		}
+		lua_pop(ptLuaState, 1);
+
+		if( tError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			break;
+		}
+	}
+
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		tError = (rd_kafka_resp_err_t)refreshMetadata(iTimeout);
+	}
+
+	return (int)tError;
+}
+
+
+
+/* Push the cached metadata. They are requested again if they are older
+ * than the refresh interval. This returns the error of the request and
+ * pushes nothing if the request failed.
+ */
+int RdKafkaCore::pushMetadata(lua_State *ptLuaState, int iTimeout)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+	if( m_ptMetadata==NULL || (kafka_get_time_ms()-m_ullMetadataTime)>=m_uiMetadataRefresh )
+	{
+		tError = (rd_kafka_resp_err_t)refreshMetadata(iTimeout);
+	}
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		kafka_push_metadata(ptLuaState, m_ptMetadata);
+	}
+
+	return (int)tError;
+}
+
+
+
+void RdKafkaCore::setMetadataRefresh(unsigned int uiInterval)
+{
+	m_uiMetadataRefresh = uiInterval;
+}
+
+
+
+/* This is true after the first fatal error of the handle. */
+bool RdKafkaCore::hasFatalError(void)
+{
+	return (__atomic_load_n(&m_iFatalError, __ATOMIC_ACQUIRE)!=0);
+}
+
+
+
+/* Read all pending bytes from the event pipe. This never blocks. */
+void RdKafkaCore::drainEventFd(void)
+{
+#if !defined(_WIN32)
+	char acBuffer[64];
+	ssize_t ssizResult;
+
+
+	if( m_aiEventPipe[0]!=-1 )
+	{
+		do
+		{
+			ssizResult = read(m_aiEventPipe[0], acBuffer, sizeof(acBuffer));
+		} while( ssizResult==(ssize_t)sizeof(acBuffer) );
+	}
+#endif
+}
+
+
+
+/* Process all reports in the ring. This never blocks. It returns the number
+ * of processed reports.
+ */
+size_t RdKafkaCore::drainRing(void)
+{
+	size_t sizTail;
+	size_t sizHead;
+	size_t sizProcessed;
+	KAFKA_RING_ENTRY_T *ptEntry;
+
+
+	sizProcessed = 0;
+	sizTail = m_sizRingTail;
+	sizHead = __atomic_load_n(&m_sizRingHead, __ATOMIC_ACQUIRE);
+	while( sizTail!=sizHead )
+	{
+		ptEntry = m_ptRing + (sizTail & m_sizRingMask);
+		processReport(ptEntry->ptOpaque, ptEntry->tError, ptEntry->iPartition, ptEntry->llOffset, ptEntry->sizLength, ptEntry->llLatency);
+		++sizTail;
+		++sizProcessed;
+	}
+	__atomic_store_n(&m_sizRingTail, sizTail, __ATOMIC_RELEASE);
+
+	return sizProcessed;
+}
+
+
+
+/* Process the reports of the background thread. Wait up to iTimeout
+ * milliseconds if there are none yet. Return the number of processed
+ * reports.
+ */
+size_t RdKafkaCore::waitForReports(int iTimeout)
+{
+	size_t sizProcessed;
+	uint64_t ullStart;
+
+
+	/* A negative timeout waits forever like rd_kafka_poll. The sleeps can
+	 * be much longer than 1ms, so measure the time with the clock.
+	 */
+	sizProcessed = drainRing();
+	ullStart = kafka_get_time_ms();
+	while( sizProcessed==0 && (iTimeout<0 || (kafka_get_time_ms()-ullStart)<(uint64_t)iTimeout) )
+	{
+		kafka_sleep_ms(1);
+		sizProcessed = drainRing();
+	}
+
+	return sizProcessed;
+}
+
+
+
 int RdKafkaCore::load_conf(lua_State *lua, rd_kafka_conf_t *conf, int idx)
 {
-  if (!conf) {
-    printf("rd_kafka_conf_new() failed, conf is NULL\n");
-    return -1;
-  }
-  if (lua_isnil(lua, idx)) {
-    return 0;
-  }
+  if (!conf) {
+    printf("rd_kafka_conf_new() failed, conf is NULL\n");
+    return -1;
+  }
+  if (lua_isnil(lua, idx)) {
+    return 0;
+  }
+
+  char errstr[512];
+  lua_pushnil(lua);
+  while (lua_next(lua, idx) != 0) {
+    int kt = lua_type(lua, -2);
+    int vt = lua_type(lua, -1);
+    switch (kt) {
+    case LUA_TSTRING:
+      switch (vt) {
+      case LUA_TSTRING:
+        {
+          const char *key = lua_tostring(lua, -2);
+          const char *value = lua_tostring(lua, -1);
+          if (value) {
+            rd_kafka_conf_res_t r;
+            r = rd_kafka_conf_set(conf, key, value, errstr, sizeof errstr);
+            if (r) {
+              printf("Failed to set %s = %s : %s", key, value,
+                              errstr);
+              return -1;
+            }
+          }
+        }
+        break;
+      case LUA_TNUMBER:
+        {
+          const char *key = lua_tostring(lua, -2);
+          int i = (int)lua_tointeger(lua, -1);
+          char value[12];
+          snprintf(value, sizeof value, "%d", i);
+          rd_kafka_conf_res_t r;
+          r = rd_kafka_conf_set(conf, key, value, errstr, sizeof errstr);
+          if (r) {
+            printf("Failed to set %s = %s : %s", key, value,
+                            errstr);
+            return -1;
+          }
+        }
+        break;
+      case LUA_TBOOLEAN:
+        {
+          const char *key = lua_tostring(lua, -2);
+          const char *value = "false";
+          if (lua_toboolean(lua, -1)) {
+            value = "true";
+          }
+          rd_kafka_conf_res_t r;
+          r = rd_kafka_conf_set(conf, key, value, errstr, sizeof errstr);
+          if (r) {
+            printf("Failed to set %s = %s : %s", key, value,
+                            errstr);
+            return -1;
+          }
+        }
+        break;
+      default:
+        printf("invalid config value type: %s",
+                        lua_typename(lua, vt));
+        return -1;
+      }
+      break;
+    default:
+      printf("invalid config key type: %s",
+                      lua_typename(lua, kt));
+      return -1;
+    }
+    lua_pop(lua, 1);
+  }
+  return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+
+Topic::Topic(RdKafkaCore *ptCore, lua_State *ptLuaState, const char *pcTopic, lua_State *ptLuaStateForConfig, int iConfigTableIndex)
+ : m_ptRk(NULL)
+ , m_ptCore(NULL)
+ , m_pcTopic(NULL)
+ , m_ptTopic(NULL)
+ , m_ptTopicState(NULL)
+ , m_fHasDeliveryCallback(false)
+ , m_uiDeliveryCallbackGeneration(0)
+ , m_fZeroCopy(false)
+ , m_sizZeroCopyMinimum(0)
+ , m_iSendTimeout(0)
+ , m_ptBatchMessages(NULL)
+ , m_puiBatchIndex(NULL)
+ , m_sizBatchMax(0)
+{
+	rd_kafka_topic_conf_t *ptConf;
+	int iResult;
+	const char *pcConfigKey;
+	bool fResult;
+
+
+	m_ptRk = ptCore->_getRk();
+
+	m_pcTopic = strdup(pcTopic);
+
+	/* Get the state for the topic name. It collects the delivery counters
+	 * and keeps the topic handles.
+	 */
+	m_ptTopicState = ptCore->getTopicState(pcTopic);
+	if( m_ptTopicState==NULL )
+	{
+		luaL_error(ptLuaState, "Failed to allocate the topic state.");
+	}
+
+	/* Reuse a topic handle with the same config. The key stays on the
+	 * stack until the handle is found or created.
+	 */
+	kafka_push_config_key(ptLuaState, (ptLuaStateForConfig!=NULL) ? iConfigTableIndex : 0);
+	pcConfigKey = lua_tostring(ptLuaState, -1);
+	m_ptTopic = ptCore->getTopicHandle(m_ptTopicState, pcConfigKey);
+	if( m_ptTopic==NULL )
+	{
+		ptConf = rd_kafka_topic_conf_new();
+		/* Load the configuration from a LUA table (if available). */
+		if( ptLuaStateForConfig!=NULL )
+		{
+			iResult = load_topic_conf(ptLuaStateForConfig, ptConf, iConfigTableIndex);
+			if( iResult!=0 )
+			{
+				rd_kafka_topic_conf_destroy(ptConf);
+				lua_error(ptLuaState);
+			}
+		}
+
+		m_ptTopic = rd_kafka_topic_new(m_ptRk, pcTopic, ptConf);
+		if( m_ptTopic==NULL )
+		{
+			rd_kafka_topic_conf_destroy(ptConf);
+			luaL_error(ptLuaState, "rd_kafka_topic_new failed");
+		}
+
+		/* The core owns the handle from now on. */
+		fResult = ptCore->addTopicHandle(m_ptTopicState, pcConfigKey, m_ptTopic);
+		if( fResult!=true )
+		{
+			rd_kafka_topic_destroy(m_ptTopic);
+			m_ptTopic = NULL;
+			luaL_error(ptLuaState, "Failed to allocate the topic handle.");
+		}
+	}
+	lua_pop(ptLuaState, 1);
+
+	m_ptCore = ptCore;
+	m_ptCore->reference();
+}
+
+
+
+/* The topic handle belongs to the core, it is reused by the next Topic with
+ * the same name and config.
+ */
+Topic::~Topic(void)
+{
+	m_ptTopic = NULL;
+
+	if( m_pcTopic!=NULL )
+	{
+		free(m_pcTopic);
+		m_pcTopic = NULL;
+	}
+
+	if( m_ptBatchMessages!=NULL )
+	{
+		free(m_ptBatchMessages);
+		m_ptBatchMessages = NULL;
+	}
+	if( m_puiBatchIndex!=NULL )
+	{
+		free(m_puiBatchIndex);
+		m_puiBatchIndex = NULL;
+	}
+	m_sizBatchMax = 0;
+
+	if( m_ptCore!=NULL )
+	{
+		/* Remove the delivery callback of this topic. All Topic objects
+		 * with the same name share the callback, so keep it if another
+		 * object installed a new one in the meantime.
+		 */
+		if( m_fHasDeliveryCallback==true && m_ptTopicState->uiDeliveryCallbackGeneration==m_uiDeliveryCallbackGeneration )
+		{
+			m_ptCore->setDeliveryCallback(NULL, 0, m_ptTopicState);
+		}
+
+		m_ptCore->dereference();
+	}
+}
+
+
+
+/* Send one message. The optional argument after the message is a key. It
+ * must be a string or nil. Pass kafka.PARTITION_UA as the partition to let
+ * the partitioner of the topic select a partition based on the key.
+ * The last optional argument is a table with message headers. The keys are
+ * the header names and the values are the header values.
+ */
+int Topic::send(lua_State *MUHKUH_LUA_STATE, int iPartition, const char *pcBUFFER_IN, size_t sizBUFFER_IN, int iBUFFER_INDEX, int iLUA_INDEX_OPTIONAL, int iLUA_TABLE_INDEX_OPTIONAL)
+{
+	int iResult;
+	rd_kafka_headers_t *ptHeaders;
+	const char *pcKey;
+	size_t sizKey;
+	KAFKA_MESSAGE_OPAQUE_T *ptOpaque;
+	int iMsgFlags;
+	lua_State *ptMainState;
+	rd_kafka_resp_err_t tError;
+	bool fRetry;
+	uint64_t ullStart;
+	uint64_t ullElapsed;
+
+
+	/* Silently ignore NULL messages. */
+	if( pcBUFFER_IN==NULL )
+	{
+		iResult = 0;
+	}
+	else
+	{
+		/* Get the optional key. librdkafka always makes a copy of the key. */
+		pcKey = NULL;
+		sizKey = 0;
+		if( iLUA_INDEX_OPTIONAL!=0 && lua_type(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL)==LUA_TSTRING )
+		{
+			pcKey = lua_tolstring(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL, &sizKey);
+		}
+
+		/* Get the optional headers. The typemap passes the stack index of
+		 * the table in iLUA_TABLE_INDEX_OPTIONAL.
+		 */
+		ptHeaders = NULL;
+		tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+		if( iLUA_TABLE_INDEX_OPTIONAL!=0 )
+		{
+			tError = kafka_create_headers(MUHKUH_LUA_STATE, iLUA_TABLE_INDEX_OPTIONAL, &ptHeaders);
+		}
+
+		/* Use the current sequence number for the new message.
+		 * Increase the sequence number counter.
+		 */
+		ptOpaque = NULL;
+		if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			ptOpaque = m_ptCore->allocateMessageOpaque(m_ptTopicState, m_ptTopicState->uiSequenceNr++);
+			if( ptOpaque==NULL )
+			{
+				tError = RD_KAFKA_RESP_ERR__FAIL;
+			}
+		}
+		if( ptOpaque==NULL )
+		{
+			if( ptHeaders!=NULL )
+			{
+				rd_kafka_headers_destroy(ptHeaders);
+			}
+			iResult = (int)tError;
+		}
+		else
+		{
+			/* Make a copy of the payload by default. */
+			iMsgFlags = RD_KAFKA_MSG_F_COPY;
+
+			/* In zero-copy mode librdkafka uses the LUA string directly.
+			 * Anchor the string in the registry until the delivery report
+			 * arrives. The typemap passes the stack index of the string in
+			 * iBUFFER_INDEX.
+			 */
+			if( m_fZeroCopy==true && sizBUFFER_IN>=m_sizZeroCopyMinimum )
+			{
+				/* Always use the main thread, a coroutine might be gone
+				 * when the delivery report arrives.
+				 */
+#if LUA_VERSION_NUM>=502
+				lua_rawgeti(MUHKUH_LUA_STATE, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+				ptMainState = lua_tothread(MUHKUH_LUA_STATE, -1);
+				lua_pop(MUHKUH_LUA_STATE, 1);
+#else
+				ptMainState = MUHKUH_LUA_STATE;
+#endif
+				lua_pushvalue(MUHKUH_LUA_STATE, iBUFFER_INDEX);
+				ptOpaque->iLuaReference = luaL_ref(MUHKUH_LUA_STATE, LUA_REGISTRYINDEX);
+				ptOpaque->ptLuaState = ptMainState;
+				iMsgFlags = 0;
+			}
+
+			/* The message is passed with the length of the LUA string. This
+			 * allows binary data with 0 bytes and does not scan the data for
+			 * a terminating 0.
+			 */
+			/* Retry a full queue until the send timeout is over. Process
+			 * delivery reports while waiting, they make room in the queue.
+			 * RD_KAFKA_MSG_F_BLOCK can not be used here as nobody would
+			 * poll the handle while this thread blocks.
+			 */
+			ullStart = kafka_get_time_ms();
+			fRetry = true;
+			while( fRetry==true )
+			{
+				tError = rd_kafka_producev(
+					/* Producer handle */
+					m_ptRk,
+					/* Topic object. */
+					RD_KAFKA_V_RKT(m_ptTopic),
+					/* Partition or RD_KAFKA_PARTITION_UA. */
+					RD_KAFKA_V_PARTITION(iPartition),
+					/* Copy the payload or use it directly. */
+					RD_KAFKA_V_MSGFLAGS(iMsgFlags),
+					/* Message value and length */
+					RD_KAFKA_V_VALUE((void*)pcBUFFER_IN, sizBUFFER_IN),
+					/* Message key and length. */
+					RD_KAFKA_V_KEY(pcKey, sizKey),
+					/* The headers or NULL. librdkafka takes the ownership
+					 * on success.
+					 */
+					RD_KAFKA_V_HEADERS(ptHeaders),
+					/* Per-Message opaque, provided in
+					 * delivery report callback as
+					 * msg_opaque. */
+					RD_KAFKA_V_OPAQUE(ptOpaque),
+					/* End sentinel */
+					RD_KAFKA_V_END
+				);
+
+				fRetry = false;
+				if( tError==RD_KAFKA_RESP_ERR__QUEUE_FULL && m_iSendTimeout>0 )
+				{
+					ullElapsed = kafka_get_time_ms() - ullStart;
+					if( ullElapsed<(uint64_t)m_iSendTimeout )
+					{
+						fRetry = m_ptCore->serviceQueue(10);
+					}
+				}
+			}
+			if( tError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+				/* The message was not accepted. There will be no delivery
+				 * report for it.
+				 */
+				m_ptCore->releaseMessageOpaque(ptOpaque);
+				if( ptHeaders!=NULL )
+				{
+					rd_kafka_headers_destroy(ptHeaders);
+				}
+			}
+			iResult = (int)tError;
+		}
+	}
+
+	return iResult;
+}
+
+
+
+void Topic::set_zero_copy(bool fZeroCopy, unsigned int uiMinimumSize)
+{
+	m_fZeroCopy = fZeroCopy;
+	m_sizZeroCopyMinimum = uiMinimumSize;
+}
+
+
+
+/* Let "send" wait up to iTimeout milliseconds if the local queue is full.
+ * A timeout of 0 returns RD_KAFKA_RESP_ERR__QUEUE_FULL at once.
+ */
+void Topic::set_send_timeout(int iTimeout)
+{
+	m_iSendTimeout = iTimeout;
+}
+
+
+
+/* Send all messages from a LUA table with rd_kafka_produce_batch. This is
+ * one call unless zero-copy mode mixes copied and referenced messages.
+ * The table is an array. Each element is either a string with the message or
+ * a table with the fields "value", "key" (optional) and "partition"
+ * (optional).
+ * This returns the number of accepted messages and a table with the error
+ * codes of all rejected messages. The keys of the error table are the indices
+ * in the message table.
+ */
+void Topic::send_batch(lua_State *ptLuaStateForTableAccess, lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, int iPartition)
+{
+	lua_State *ptL;
+	const int iTableIndex = 2;
+	size_t sizElements;
+	size_t sizCnt;
+	size_t sizBatch;
+	size_t sizNewMax;
+	rd_kafka_message_t *ptNewMessages;
+	unsigned int *puiNewIndex;
+	rd_kafka_message_t *ptMessage;
+	KAFKA_MESSAGE_OPAQUE_T *ptOpaque;
+	lua_State *ptMainState;
+	int iType;
+	int iMsgFlags;
+	int iAccepted;
+	size_t sizRunStart;
+	size_t sizRunEnd;
+	bool fCopy;
+	const char *pcValue;
+	size_t sizValue;
+	const char *pcKey;
+	size_t sizKey;
+	int32_t iMessagePartition;
+
+
+	ptL = ptLuaStateForTableAccess;
+
+	/* Get the number of elements in the table. */
+#if LUA_VERSION_NUM>=502
+	sizElements = lua_rawlen(ptL, iTableIndex);
+#else
+	sizElements = lua_objlen(ptL, iTableIndex);
+#endif
+
+	/* Create the table for the errors. */
+	lua_newtable(ptL);
+
+	/* Grow the buffers if necessary. */
+	if( sizElements>m_sizBatchMax )
+	{
+		sizNewMax = m_sizBatchMax;
+		if( sizNewMax==0 )
+		{
+			sizNewMax = 64;
+		}
+		while( sizNewMax<sizElements )
+		{
+			sizNewMax *= 2;
+		}
+
+		ptNewMessages = (rd_kafka_message_t*)realloc(m_ptBatchMessages, sizNewMax*sizeof(rd_kafka_message_t));
+		if( ptNewMessages!=NULL )
+		{
+			m_ptBatchMessages = ptNewMessages;
+		}
+		puiNewIndex = (unsigned int*)realloc(m_puiBatchIndex, sizNewMax*sizeof(unsigned int));
+		if( puiNewIndex!=NULL )
+		{
+			m_puiBatchIndex = puiNewIndex;
+		}
+		if( ptNewMessages==NULL || puiNewIndex==NULL )
+		{
+			luaL_error(ptL, "Failed to allocate the batch buffer for %d messages.", (int)sizElements);
+		}
+		m_sizBatchMax = sizNewMax;
+	}
+
+	/* Look for a main thread to anchor strings in zero-copy mode. */
+	ptMainState = NULL;
+	if( m_fZeroCopy==true )
+	{
+#if LUA_VERSION_NUM>=502
+		lua_rawgeti(ptL, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+		ptMainState = lua_tothread(ptL, -1);
+		lua_pop(ptL, 1);
+#else
+		ptMainState = ptL;
+#endif
+	}
+
+	/* Collect all messages. The strings stay on the LUA side, they are
+	 * referenced by the message table during the complete call.
+	 */
+	sizBatch = 0;
+	for(sizCnt=1; sizCnt<=sizElements; ++sizCnt)
+	{
+		pcValue = NULL;
+		sizValue = 0;
+		pcKey = NULL;
+		sizKey = 0;
+		iMessagePartition = iPartition;
+
+		lua_rawgeti(ptL, iTableIndex, sizCnt);
+		iType = lua_type(ptL, -1);
+		if( iType==LUA_TSTRING )
+		{
+			pcValue = lua_tolstring(ptL, -1, &sizValue);
+		}
+		else if( iType==LUA_TTABLE )
+		{
+			lua_getfield(ptL, -1, "value");
+			if( lua_type(ptL, -1)==LUA_TSTRING )
+			{
+				pcValue = lua_tolstring(ptL, -1, &sizValue);
+				/* Replace the message table with the value. */
+				lua_remove(ptL, -2);
+				/* The key and partition are read from the message table
+				 * below the value.
+				 */
+				lua_rawgeti(ptL, iTableIndex, sizCnt);
+				lua_getfield(ptL, -1, "key");
+				if( lua_type(ptL, -1)==LUA_TSTRING )
+				{
+					pcKey = lua_tolstring(ptL, -1, &sizKey);
+				}
+				lua_pop(ptL, 1);
+				lua_getfield(ptL, -1, "partition");
+				if( lua_type(ptL, -1)==LUA_TNUMBER )
+				{
+					iMessagePartition = (int32_t)lua_tointeger(ptL, -1);
+				}
+				lua_pop(ptL, 2);
+			}
+			else
+			{
+				lua_pop(ptL, 1);
+			}
+		}
+
+		if( pcValue==NULL )
+		{
+			/* This element is not valid. */
+#if LUA_VERSION_NUM>=504
+			lua_pushinteger(ptL, RD_KAFKA_RESP_ERR__INVALID_ARG);
+#else
+			lua_pushnumber(ptL, RD_KAFKA_RESP_ERR__INVALID_ARG);
+#endif
+			lua_rawseti(ptL, -3, sizCnt);
+		}
+		else
+		{
+			ptOpaque = m_ptCore->allocateMessageOpaque(m_ptTopicState, m_ptTopicState->uiSequenceNr++);
+			if( ptOpaque==NULL )
+			{
+#if LUA_VERSION_NUM>=504
+				lua_pushinteger(ptL, RD_KAFKA_RESP_ERR__FAIL);
+#else
+				lua_pushnumber(ptL, RD_KAFKA_RESP_ERR__FAIL);
+#endif
+				lua_rawseti(ptL, -3, sizCnt);
+			}
+			else
+			{
+				/* Anchor the value in zero-copy mode. It is on top of the
+				 * stack. Values below the minimum size are copied.
+				 */
+				if( ptMainState!=NULL && sizValue>=m_sizZeroCopyMinimum )
+				{
+					lua_pushvalue(ptL, -1);
+					ptOpaque->iLuaReference = luaL_ref(ptL, LUA_REGISTRYINDEX);
+					ptOpaque->ptLuaState = ptMainState;
+				}
+
+				ptMessage = m_ptBatchMessages + sizBatch;
+				memset(ptMessage, 0, sizeof(rd_kafka_message_t));
+				ptMessage->partition = iMessagePartition;
+				ptMessage->payload = (void*)pcValue;
+				ptMessage->len = sizValue;
+				ptMessage->key = (void*)pcKey;
+				ptMessage->key_len = sizKey;
+				ptMessage->_private = ptOpaque;
+				m_puiBatchIndex[sizBatch] = (unsigned int)sizCnt;
+				++sizBatch;
+			}
+		}
+		lua_pop(ptL, 1);
+	}
+
+	/* The flags of rd_kafka_produce_batch are for all messages. Send runs
+	 * of messages with the same copy mode to apply the zero-copy minimum
+	 * per message. The runs keep the order of the messages.
+	 */
+	iAccepted = 0;
+	sizRunStart = 0;
+	while( sizRunStart<sizBatch )
+	{
+		fCopy = (m_fZeroCopy==false || m_ptBatchMessages[sizRunStart].len<m_sizZeroCopyMinimum);
+		sizRunEnd = sizRunStart + 1;
+		while( sizRunEnd<sizBatch && fCopy==(m_fZeroCopy==false || m_ptBatchMessages[sizRunEnd].len<m_sizZeroCopyMinimum) )
+		{
+			++sizRunEnd;
+		}
+
+		iMsgFlags = RD_KAFKA_MSG_F_PARTITION;
+		if( fCopy==true )
+		{
+			iMsgFlags |= RD_KAFKA_MSG_F_COPY;
+		}
+		iAccepted += rd_kafka_produce_batch(m_ptTopic, iPartition, iMsgFlags, m_ptBatchMessages + sizRunStart, (int)(sizRunEnd - sizRunStart));
+		sizRunStart = sizRunEnd;
+	}
+
+	/* Collect the errors. There will be no delivery report for the
+	 * rejected messages.
+	 */
+	if( iAccepted!=(int)sizBatch )
+	{
+		for(sizCnt=0; sizCnt<sizBatch; ++sizCnt)
+		{
+			ptMessage = m_ptBatchMessages + sizCnt;
+			if( ptMessage->err!=RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+				m_ptCore->releaseMessageOpaque((KAFKA_MESSAGE_OPAQUE_T*)(ptMessage->_private));
+#if LUA_VERSION_NUM>=504
+				lua_pushinteger(ptL, ptMessage->err);
+#else
+				lua_pushnumber(ptL, ptMessage->err);
+#endif
+				lua_rawseti(ptL, -2, m_puiBatchIndex[sizCnt]);
+			}
+		}
+	}
+
+	/* Push the number of accepted messages and move it below the error
+	 * table.
+	 */
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptL, iAccepted);
+#else
+	lua_pushnumber(ptL, iAccepted);
+#endif
+	lua_insert(ptL, -2);
+}
+
+
+
+void Topic::poll(lua_State *MUHKUH_LUA_STATE, uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout)
+{
+	void *pvMsgOpaque;
+	unsigned int uiFailures;
+
+
+	m_ptCore->poll(MUHKUH_LUA_STATE, iTimeout, &pvMsgOpaque, &uiFailures);
+
+	*puiUINT_OR_NIL = (uintptr_t)pvMsgOpaque;
+	*puiUINT_OUT = uiFailures;
+}
+
+
+
+/* Poll the producer and return the delivery reports of this topic. The
+ * reports of other topics are kept for their next poll_reports.
+ */
+void Topic::poll_reports(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout)
+{
+	m_ptCore->pollReports(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iTimeout, m_ptTopicState);
+}
+
+
+
+/* Set a LUA function which is called from poll with a table of all delivery
+ * reports for this topic. Pass nil to remove the callback.
+ */
+void Topic::set_delivery_callback(lua_State *MUHKUH_LUA_STATE, int iLUA_INDEX_OPTIONAL)
+{
+	m_ptCore->setDeliveryCallback(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL, m_ptTopicState);
+	m_fHasDeliveryCallback = (iLUA_INDEX_OPTIONAL!=0 && lua_type(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL)==LUA_TFUNCTION);
+	m_uiDeliveryCallbackGeneration = m_ptTopicState->uiDeliveryCallbackGeneration;
+}
+
+
+
+const KAFKA_DELIVERY_STATISTICS_T *Topic::_getDeliveryStatistics(void)
+{
+	const KAFKA_DELIVERY_STATISTICS_T *ptStatistics;
+
+
+	ptStatistics = NULL;
+	if( m_ptTopicState!=NULL )
+	{
+		ptStatistics = &(m_ptTopicState->tStatistics);
+	}
+
+	return ptStatistics;
+}
+
+
+
+void Topic::get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	KAFKA_DELIVERY_STATISTICS_T tEmpty;
+
+
+	if( m_ptTopicState!=NULL )
+	{
+		kafka_push_delivery_statistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, &(m_ptTopicState->tStatistics));
+	}
+	else
+	{
+		memset(&tEmpty, 0, sizeof(KAFKA_DELIVERY_STATISTICS_T));
+		kafka_push_delivery_statistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, &tEmpty);
+	}
+}
+
+
+
+/* Return the latency from "send" to the delivery report in microseconds. The
+ * table has the fields "count", "min", "max", "mean", "p50", "p90", "p99" and
+ * "p999". Only "count" is set if no message was delivered yet.
+ * The latency is collected for the topic name, all Topic objects with the
+ * same name share it.
+ */
+void Topic::get_latency(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	const KAFKA_LATENCY_HISTOGRAM_T *ptHistogram;
+	lua_State *ptL;
+	uint64_t ullCount;
+
+
+	ptL = MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT;
+	ptHistogram = NULL;
+	if( m_ptTopicState!=NULL )
+	{
+		ptHistogram = m_ptTopicState->ptLatency;
+	}
+	ullCount = 0;
+	if( ptHistogram!=NULL )
+	{
+		ullCount = ptHistogram->ullCount;
+	}
+
+	lua_createtable(ptL, 0, 8);
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(ptL, (lua_Integer)ullCount);
+#else
+	lua_pushnumber(ptL, (lua_Number)ullCount);
+#endif
+	lua_setfield(ptL, -2, "count");
+	if( ullCount!=0 )
+	{
+		lua_pushnumber(ptL, (lua_Number)(ptHistogram->ullSum) / (lua_Number)ullCount);
+		lua_setfield(ptL, -2, "mean");
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(ptL, (lua_Integer)(ptHistogram->ullMin));
+		lua_setfield(ptL, -2, "min");
+		lua_pushinteger(ptL, (lua_Integer)(ptHistogram->ullMax));
+		lua_setfield(ptL, -2, "max");
+		lua_pushinteger(ptL, (lua_Integer)kafka_latency_percentile(ptHistogram, 50.0));
+		lua_setfield(ptL, -2, "p50");
+		lua_pushinteger(ptL, (lua_Integer)kafka_latency_percentile(ptHistogram, 90.0));
+		lua_setfield(ptL, -2, "p90");
+		lua_pushinteger(ptL, (lua_Integer)kafka_latency_percentile(ptHistogram, 99.0));
+		lua_setfield(ptL, -2, "p99");
+		lua_pushinteger(ptL, (lua_Integer)kafka_latency_percentile(ptHistogram, 99.9));
+		lua_setfield(ptL, -2, "p999");
+#else
+		lua_pushnumber(ptL, (lua_Number)(ptHistogram->ullMin));
+		lua_setfield(ptL, -2, "min");
+		lua_pushnumber(ptL, (lua_Number)(ptHistogram->ullMax));
+		lua_setfield(ptL, -2, "max");
+		lua_pushnumber(ptL, (lua_Number)kafka_latency_percentile(ptHistogram, 50.0));
+		lua_setfield(ptL, -2, "p50");
+		lua_pushnumber(ptL, (lua_Number)kafka_latency_percentile(ptHistogram, 90.0));
+		lua_setfield(ptL, -2, "p90");
+		lua_pushnumber(ptL, (lua_Number)kafka_latency_percentile(ptHistogram, 99.0));
+		lua_setfield(ptL, -2, "p99");
+		lua_pushnumber(ptL, (lua_Number)kafka_latency_percentile(ptHistogram, 99.9));
+		lua_setfield(ptL, -2, "p999");
+#endif
+	}
+}
+
+
+
+void Topic::reset_latency(void)
+{
+	if( m_ptTopicState!=NULL && m_ptTopicState->ptLatency!=NULL )
+	{
+		memset(m_ptTopicState->ptLatency, 0, sizeof(KAFKA_LATENCY_HISTOGRAM_T));
+	}
+}
+
+
+
+const char *Topic::error2string(int iError)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = (rd_kafka_resp_err_t)iError;
+	return rd_kafka_err2str(tError);
+}
+
+
+
+int Topic::load_topic_conf(lua_State *ptLua, rd_kafka_topic_conf_t *ptConf, int idx)
+{
+  if (!ptConf) {
+    lua_pushstring(ptLua, "rd_kafka_topic_conf_new() failed");
+    return -1;
+  }
+  if (lua_isnil(ptLua, idx)) {
+    return 0;
+  }
+
+  char errstr[512];
+  lua_pushnil(ptLua);
+  while (lua_next(ptLua, idx) != 0) {
+    int kt = lua_type(ptLua, -2);
+    int vt = lua_type(ptLua, -1);
+    switch (kt) {
+    case LUA_TSTRING:
+      switch (vt) {
+      case LUA_TSTRING:
+        {
+          const char *key = lua_tostring(ptLua, -2);
+          const char *value = lua_tostring(ptLua, -1);
+          if (value) {
+            rd_kafka_conf_res_t r;
+            r = rd_kafka_topic_conf_set(ptConf, key, value, errstr,
+                                        sizeof errstr);
+            if (r) {
+              lua_pushfstring(ptLua, "Failed to set %s = %s : %s", key, value,
+                              errstr);
+              return -1;
+            }
+          }
+        }
+        break;
+      case LUA_TNUMBER:
+        {
+          const char *key = lua_tostring(ptLua, -2);
+          int i = (int)lua_tointeger(ptLua, -1);
+          char value[12];
+          snprintf(value, sizeof value, "%d", i);
+          rd_kafka_conf_res_t r;
+          r = rd_kafka_topic_conf_set(ptConf, key, value, errstr,
+                                      sizeof errstr);
+          if (r) {
+            lua_pushfstring(ptLua, "Failed to set %s = %s : %s", key, value,
+                            errstr);
+            return -1;
+          }
+        }
+        break;
+      case LUA_TBOOLEAN:
+        {
+          const char *key = lua_tostring(ptLua, -2);
+          const char *value = "false";
+          if (lua_toboolean(ptLua, -1)) {
+            value = "true";
+          }
+          rd_kafka_conf_res_t r;
+          r = rd_kafka_topic_conf_set(ptConf, key, value, errstr,
+                                      sizeof errstr);
+          if (r) {
+            lua_pushfstring(ptLua, "Failed to set %s = %s : %s", key, value,
+                            errstr);
+            return -1;
+          }
+        }
+        break;
+      default:
+        lua_pushfstring(ptLua, "invalid config value type: %s",
+                        lua_typename(ptLua, vt));
+        return -1;
+      }
+      break;
+    default:
+      lua_pushfstring(ptLua, "invalid config key type: %s",
+                      lua_typename(ptLua, kt));
+      return -1;
+    }
+    lua_pop(ptLua, 1);
+  }
+  return 0;
+}
+
+
+
+/*--------------------------------------------------------------------------*/
+
+/* Create a new producer. If the optional fourth argument is true, the
+ * producer shares its librdkafka handle with all other shared producers of
+ * the LUA state which have the same broker list and config. This saves the
+ * threads and connections of a handle. The shared producers also share the
+ * delivery counters, the delivery callback for all messages, the verbose
+ * and background poll modes and a transaction.
+ * Pass an empty config table to share a producer without config.
+ */
+Producer::Producer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, lua_State *ptLuaStateForTableAccessOptional, bool fBOOL_OPTIONAL)
+ : m_ptCore(NULL)
+ , m_tTransactionError(RD_KAFKA_RESP_ERR_NO_ERROR)
+ , m_pcTransactionError(NULL)
+ , m_fTransactionErrorIsFatal(false)
+ , m_fTransactionErrorIsRetriable(false)
+ , m_fTransactionErrorRequiresAbort(false)
+{
+	const char *pcSharedKey;
+
+
+	if( ptLuaStateForTableAccessOptional==NULL )
+	{
+		printf("Producer(%p) created without config.\n", this);
+	}
+	else
+	{
+		printf("Producer(%p) created with config.\n", this);
+	}
+
+	/* Look for a shared core with the same brokers and config. The key
+	 * stays on the stack until the constructor is done.
+	 */
+	pcSharedKey = NULL;
+	if( fBOOL_OPTIONAL==true )
+	{
+		kafka_push_shared_core_key(MUHKUH_LUA_STATE, RD_KAFKA_PRODUCER, pcBrokerList, (ptLuaStateForTableAccessOptional!=NULL) ? 2 : 0);
+		pcSharedKey = lua_tostring(MUHKUH_LUA_STATE, -1);
+		m_ptCore = RdKafkaCore::getSharedCore(pcSharedKey);
+		if( m_ptCore!=NULL )
+		{
+			printf("Producer(%p) uses the shared core %p.\n", this, m_ptCore);
+		}
+	}
+
+	/* Create a new core. */
+	if( m_ptCore==NULL )
+	{
+		m_ptCore = new RdKafkaCore();
+		if( m_ptCore!=NULL )
+		{
+			m_ptCore->createCore(RD_KAFKA_PRODUCER, pcBrokerList, NULL, MUHKUH_LUA_STATE, ptLuaStateForTableAccessOptional, 2);
+			m_ptCore->reference();
+			if( pcSharedKey!=NULL )
+			{
+				m_ptCore->setShared(pcSharedKey);
+			}
+		}
+	}
+
+	if( pcSharedKey!=NULL )
+	{
+		lua_pop(MUHKUH_LUA_STATE, 1);
+	}
+}
+
+
+
+Producer::~Producer(void)
+{
+	if( m_pcTransactionError!=NULL )
+	{
+		free(m_pcTransactionError);
+		m_pcTransactionError = NULL;
+	}
+
+	if( m_ptCore!=NULL )
+	{
+		m_ptCore->dereference();
+		m_ptCore = NULL;
+	}
+
+	printf("Producer(%p) deleted.\n", this);
+}
+
+
+
+void Producer::poll(lua_State *MUHKUH_LUA_STATE, uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout)
+{
+	void *pvMsgOpaque;
+	unsigned int uiFailures;
+
+
+	m_ptCore->poll(MUHKUH_LUA_STATE, iTimeout, &pvMsgOpaque, &uiFailures);
+
+	*puiUINT_OR_NIL = (uintptr_t)pvMsgOpaque;
+	*puiUINT_OUT = uiFailures;
+}
+
+
+
+void Producer::poll_reports(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout)
+{
+	m_ptCore->pollReports(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iTimeout, NULL);
+}
+
+
+
+/* Set a LUA function which is called from poll with a table of all delivery
+ * reports. Pass nil to remove the callback.
+ */
+void Producer::set_delivery_callback(lua_State *MUHKUH_LUA_STATE, int iLUA_INDEX_OPTIONAL)
+{
+	m_ptCore->setDeliveryCallback(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL, NULL);
+}
+
+
+
+int Producer::flush(int iTimeout)
+{
+	int iResult;
+
+
+	iResult = m_ptCore->flush(iTimeout);
+	return iResult;
+}
+
+
+
+/* Return the delivery counters of all topics. There is no "last_acked"
+ * field as the sequence numbers are counted per topic.
+ */
+void Producer::get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	kafka_push_delivery_statistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_ptCore->getDeliveryStatistics());
+}
+
+
+
+/* Print a line for each delivery report. This is for debugging only. */
+void Producer::set_verbose(bool fVerbose)
+{
+	m_ptCore->setVerbose(fVerbose);
+}
+
+
+
+/* Return a table with the fields "length", "max_messages" and "max_kbytes".
+ * "length" is the number of messages and requests in the local queue. The
+ * other fields are the configured limits of the queue.
+ */
+void Producer::queue_status(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	int iLength;
+	unsigned int uiMaxMessages;
+	unsigned int uiMaxKBytes;
+
+
+	m_ptCore->getQueueStatus(&iLength, &uiMaxMessages, &uiMaxKBytes);
+
+	lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0, 3);
+#if LUA_VERSION_NUM>=504
+	lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iLength);
+	lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "length");
+	lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, uiMaxMessages);
+	lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "max_messages");
+	lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, uiMaxKBytes);
+	lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "max_kbytes");
+#else
+	lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iLength);
+	lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "length");
+	lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, uiMaxMessages);
+	lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "max_messages");
+	lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, uiMaxKBytes);
+	lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "max_kbytes");
+#endif
+}
+
+
+
+/* Return the most important values of the latest librdkafka statistics.
+ * The statistics are only collected if "statistics.interval.ms" is set in
+ * the configuration and they are updated by "poll". This returns nil if
+ * there are no statistics yet.
+ */
+void Producer::get_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	m_ptCore->pushStatistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+}
+
+
+
+/* Return the latest librdkafka statistics as a JSON string or nil. */
+void Producer::get_stats_json(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	m_ptCore->pushStatisticsJson(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+}
+
+
+
+/* Poll the producer in a native thread. This keeps the delivery reports
+ * flowing if the script does not call "poll" for a while. The reports are
+ * still processed in the next call to "poll" or "poll_reports".
+ */
+int Producer::start_background_poll(unsigned int uiRingSize)
+{
+	return m_ptCore->startBackgroundPoll(uiRingSize);
+}
+
+
+
+void Producer::stop_background_poll(void)
+{
+	m_ptCore->stopBackgroundPoll();
+}
+
+
+
+/* Return a file descriptor for "select" or an event loop. It becomes
+ * readable if delivery reports or errors are waiting. Call "poll" until
+ * there are no more reports after each wakeup. This returns nil if the
+ * platform does not support it.
+ */
+void Producer::get_event_fd(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	int iFd;
+
+
+	iFd = m_ptCore->getEventFd();
+	if( iFd==-1 )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iFd);
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iFd);
+#endif
+	}
+}
+
+
+
+const char *Producer::error2string(int iError)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = (rd_kafka_resp_err_t)iError;
+	return rd_kafka_err2str(tError);
+}
+
+
+
+Topic *Producer::create_topic(lua_State *MUHKUH_LUA_STATE, const char *pcTopic, lua_State *ptLuaStateForTableAccessOptional)
+{
+	Topic *ptTopic;
+
+
+	if( m_ptCore->getVerbose()==true )
+	{
+		if( ptLuaStateForTableAccessOptional==NULL )
+		{
+			printf("Producer(%p) create_topic without config.\n", this);
+		}
+		else
+		{
+			printf("Producer(%p) create_topic with config.\n", this);
+		}
+	}
+
+	ptTopic = new Topic(m_ptCore, MUHKUH_LUA_STATE, pcTopic, ptLuaStateForTableAccessOptional, 3);
+	return ptTopic;
+}
+
+
+
+/* Make the topics in the array known to the producer and request their
+ * metadata. Call this during startup to avoid the metadata round trip with
+ * the first message of each topic.
+ */
+int Producer::prefetch_metadata(lua_State *ptLuaStateForTableAccess, int iTimeout)
+{
+	return m_ptCore->prefetchMetadata(ptLuaStateForTableAccess, 2, iTimeout);
+}
+
+
+
+/* Return the metadata of all topics which are known to the producer. The
+ * result is cached for the refresh interval. This returns nil and an error
+ * message if the request failed.
+ */
+void Producer::get_metadata(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, int iTimeout)
+{
+	int iResult;
+
+
+	iResult = m_ptCore->pushMetadata(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, iTimeout);
+	if( iResult==0 )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR);
+	}
+	else
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR);
+		lua_pushstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, rd_kafka_err2str((rd_kafka_resp_err_t)iResult));
+	}
+}
+
+
+
+/* Set the maximum age of the cached metadata in milliseconds. The default
+ * is "topic.metadata.refresh.interval.ms" from the config.
+ */
+void Producer::set_metadata_refresh(unsigned int uiInterval)
+{
+	m_ptCore->setMetadataRefresh(uiInterval);
+}
+
+
+
+/* Keep the details of a transaction result for "get_transaction_error" and
+ * return the error code. This frees the error object.
+ */
+int Producer::setTransactionError(rd_kafka_error_t *ptError)
+{
+	if( m_pcTransactionError!=NULL )
+	{
+		free(m_pcTransactionError);
+		m_pcTransactionError = NULL;
+	}
+
+	if( ptError==NULL )
+	{
+		m_tTransactionError = RD_KAFKA_RESP_ERR_NO_ERROR;
+		m_fTransactionErrorIsFatal = false;
+		m_fTransactionErrorIsRetriable = false;
+		m_fTransactionErrorRequiresAbort = false;
+	}
+	else
+	{
+		m_tTransactionError = rd_kafka_error_code(ptError);
+		m_pcTransactionError = strdup(rd_kafka_error_string(ptError));
+		m_fTransactionErrorIsFatal = (rd_kafka_error_is_fatal(ptError)!=0);
+		m_fTransactionErrorIsRetriable = (rd_kafka_error_is_retriable(ptError)!=0);
+		m_fTransactionErrorRequiresAbort = (rd_kafka_error_txn_requires_abort(ptError)!=0);
+		rd_kafka_error_destroy(ptError);
+	}
+
+	return (int)m_tTransactionError;
+}
+
+
+
+/* Prepare the producer for transactions. This needs a "transactional.id" in
+ * the configuration of the producer. It also turns on the idempotence,
+ * which keeps the order of the messages with up to 5 requests in flight
+ * per connection.
+ * Call this once before the first "begin_transaction".
+ */
+int Producer::init_transactions(int iTimeout)
+{
+	return setTransactionError(rd_kafka_init_transactions(m_ptCore->_getRk(), iTimeout));
+}
+
+
+
+int Producer::begin_transaction(void)
+{
+	return setTransactionError(rd_kafka_begin_transaction(m_ptCore->_getRk()));
+}
+
+
+
+/* Add the offsets stored in a consumer to the current transaction. They
+ * are committed together with the messages of the transaction. The stored
+ * offsets of the consumer are cleared on success, they must not be
+ * committed again with "commit_async".
+ */
+int Producer::send_offsets_to_transaction(Consumer *ptConsumer, int iTimeout)
+{
+	rd_kafka_consumer_group_metadata_t *ptGroupMetadata;
+	rd_kafka_topic_partition_list_t *ptOffsets;
+	rd_kafka_error_t *ptError;
+	int iResult;
+
+
+	iResult = RD_KAFKA_RESP_ERR__INVALID_ARG;
+	if( ptConsumer!=NULL )
+	{
+		ptOffsets = ptConsumer->_getPendingOffsets();
+		if( ptOffsets->cnt==0 )
+		{
+			/* Nothing to do. */
+			iResult = setTransactionError(NULL);
+		}
+		else
+		{
+			ptGroupMetadata = rd_kafka_consumer_group_metadata(ptConsumer->_getRk());
+			ptError = rd_kafka_send_offsets_to_transaction(m_ptCore->_getRk(), ptOffsets, ptGroupMetadata, iTimeout);
+			rd_kafka_consumer_group_metadata_destroy(ptGroupMetadata);
+
+			iResult = setTransactionError(ptError);
+			if( iResult==RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+				ptConsumer->_clearPendingOffsets();
+			}
+		}
+	}
+
+	return iResult;
+}
+
+
+
+/* Commit the current transaction. This flushes all messages first.
+ * librdkafka serves the delivery reports of the flush in this thread, so a
+ * running background poll is paused during the call.
+ */
+int Producer::commit_transaction(int iTimeout)
+{
+	bool fBackgroundPoll;
+	int iResult;
+
+
+	fBackgroundPoll = m_ptCore->pauseBackgroundPoll();
+	iResult = setTransactionError(rd_kafka_commit_transaction(m_ptCore->_getRk(), iTimeout));
+	if( fBackgroundPoll==true )
+	{
+		m_ptCore->resumeBackgroundPoll();
+	}
+
+	return iResult;
+}
+
+
+
+/* Abort the current transaction. This purges and flushes the messages of
+ * the transaction like "commit_transaction".
+ */
+int Producer::abort_transaction(int iTimeout)
+{
+	bool fBackgroundPoll;
+	int iResult;
+
+
+	fBackgroundPoll = m_ptCore->pauseBackgroundPoll();
+	iResult = setTransactionError(rd_kafka_abort_transaction(m_ptCore->_getRk(), iTimeout));
+	if( fBackgroundPoll==true )
+	{
+		m_ptCore->resumeBackgroundPoll();
+	}
+
+	return iResult;
+}
+
+
+
+/* Return the details of the last failed transaction call in a table with
+ * the fields "error", "message", "fatal", "retriable" and "requires_abort".
+ * A retriable call can be repeated. If the current transaction requires an
+ * abort, call "abort_transaction" and start again. A fatal error needs a new
+ * producer.
+ * This returns nil if the last call succeeded.
+ */
+void Producer::get_transaction_error(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	if( m_tTransactionError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0, 5);
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_tTransactionError);
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_tTransactionError);
+#endif
+		lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "error");
+		if( m_pcTransactionError!=NULL )
+		{
+			lua_pushstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_pcTransactionError);
+		}
+		else
+		{
+			lua_pushstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, rd_kafka_err2str(m_tTransactionError));
+		}
+		lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "message");
+		lua_pushboolean(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_fTransactionErrorIsFatal);
+		lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "fatal");
+		lua_pushboolean(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_fTransactionErrorIsRetriable);
+		lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "retriable");
+		lua_pushboolean(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_fTransactionErrorRequiresAbort);
+		lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, "requires_abort");
+	}
+}
+
+
+
+/* Return the error code and the reason of a fatal error. After a fatal
+ * error the producer does not accept any more messages and must be
+ * replaced. This returns nil, nil if there was no fatal error.
+ */
+void Producer::get_fatal_error(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR)
+{
+	rd_kafka_resp_err_t tError;
+	char acReason[512];
+
+
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+	if( m_ptCore->hasFatalError()==true )
+	{
+		tError = rd_kafka_fatal_error(m_ptCore->_getRk(), acReason, sizeof(acReason));
+	}
+
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR);
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR);
+	}
+	else
+	{
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, tError);
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, tError);
+#endif
+		lua_pushstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, acReason);
+	}
+}
+
+
+
+/*--------------------------------------------------------------------------*/
+
+ShardedTopic::ShardedTopic(RdKafkaCore **pptCores, unsigned int uiShards, lua_State *ptLuaState, const char *pcTopic, lua_State *ptLuaStateForConfig, int iConfigTableIndex)
+ : m_pptTopics(NULL)
+ , m_uiShards(0)
+ , m_uiNextShard(0)
+{
+	unsigned int uiCnt;
+
+
+	m_pptTopics = (Topic**)malloc(uiShards * sizeof(Topic*));
+	if( m_pptTopics==NULL )
+	{
+		luaL_error(ptLuaState, "Failed to allocate the topics for %d shards.", uiShards);
+	}
+
+	/* Count the topics as they are created. The destructor only deletes
+	 * the complete ones.
+	 */
+	for(uiCnt=0; uiCnt<uiShards; ++uiCnt)
+	{
+		m_pptTopics[uiCnt] = new Topic(pptCores[uiCnt], ptLuaState, pcTopic, ptLuaStateForConfig, iConfigTableIndex);
+		m_uiShards = uiCnt + 1;
+	}
+}
+
+
+
+ShardedTopic::~ShardedTopic(void)
+{
+	unsigned int uiCnt;
+
+
+	if( m_pptTopics!=NULL )
+	{
+		for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+		{
+			delete m_pptTopics[uiCnt];
+		}
+		free(m_pptTopics);
+		m_pptTopics = NULL;
+	}
+	m_uiShards = 0;
+}
+
+
+
+/* Select the shard for a message. A key is hashed with FNV-1a, messages
+ * without a key are sent round-robin.
+ */
+unsigned int ShardedTopic::getShard(const char *pcKey, size_t sizKey)
+{
+	uint32_t ulHash;
+	size_t sizCnt;
+	unsigned int uiShard;
+
+
+	if( pcKey!=NULL )
+	{
+		ulHash = 2166136261U;
+		for(sizCnt=0; sizCnt<sizKey; ++sizCnt)
+		{
+			ulHash ^= (unsigned char)(pcKey[sizCnt]);
+			ulHash *= 16777619U;
+		}
+		uiShard = ulHash % m_uiShards;
+	}
+	else
+	{
+		uiShard = m_uiNextShard;
+		++m_uiNextShard;
+		if( m_uiNextShard>=m_uiShards )
+		{
+			m_uiNextShard = 0;
+		}
+	}
+
+	return uiShard;
+}
+
+
+
+/* Send one message to the shard of its key. The arguments are the same as
+ * for "Topic:send". The stack indices of the value, the key and the
+ * headers are passed on, so the Topic of the shard reads them directly.
+ */
+int ShardedTopic::send(lua_State *MUHKUH_LUA_STATE, int iPartition, const char *pcBUFFER_IN, size_t sizBUFFER_IN, int iBUFFER_INDEX, int iLUA_INDEX_OPTIONAL, int iLUA_TABLE_INDEX_OPTIONAL)
+{
+	const char *pcKey;
+	size_t sizKey;
+	unsigned int uiShard;
+
+
+	pcKey = NULL;
+	sizKey = 0;
+	if( iLUA_INDEX_OPTIONAL!=0 && lua_type(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL)==LUA_TSTRING )
+	{
+		pcKey = lua_tolstring(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL, &sizKey);
+	}
+	uiShard = getShard(pcKey, sizKey);
+
+	return m_pptTopics[uiShard]->send(MUHKUH_LUA_STATE, iPartition, pcBUFFER_IN, sizBUFFER_IN, iBUFFER_INDEX, iLUA_INDEX_OPTIONAL, iLUA_TABLE_INDEX_OPTIONAL);
+}
+
+
+
+/* Send all messages from a LUA table. The table has the same format as for
+ * "Topic:send_batch". The messages are split into one batch per shard.
+ * This returns the number of accepted messages and a table with the error
+ * codes of all rejected messages. The keys of the error table are the
+ * indices in the message table.
+ */
+void ShardedTopic::send_batch(lua_State *ptLuaStateForTableAccess, lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, int iPartition)
+{
+	lua_State *ptL;
+	const int iTableIndex = 2;
+	int iTop;
+	int iMessagesIndex;
+	int iIndicesIndex;
+	int iErrorsIndex;
+	size_t sizElements;
+	size_t sizCnt;
+	size_t *psizShardElements;
+	unsigned int uiShard;
+	const char *pcKey;
+	size_t sizKey;
+	int iAccepted;
+	int iIndex;
+
+
+	ptL = ptLuaStateForTableAccess;
+	if( m_uiShards==1 )
+	{
+		m_pptTopics[0]->send_batch(ptL, MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, iPartition);
+	}
+	else
+	{
+		psizShardElements = (size_t*)calloc(m_uiShards, sizeof(size_t));
+		if( psizShardElements==NULL )
+		{
+			luaL_error(ptL, "Failed to allocate the batch counters for %d shards.", m_uiShards);
+		}
+
+#if LUA_VERSION_NUM>=502
+		sizElements = lua_rawlen(ptL, iTableIndex);
+#else
+		sizElements = lua_objlen(ptL, iTableIndex);
+#endif
+
+		/* Keep the original table. It is replaced by the batch of each
+		 * shard.
+		 */
+		iTop = lua_gettop(ptL);
+		lua_pushvalue(ptL, iTableIndex);
+
+		/* Create one message table and one table with the original indices
+		 * for each shard.
+		 */
+		iMessagesIndex = iTop + 2;
+		iIndicesIndex = iTop + 2 + m_uiShards;
+		iErrorsIndex = iTop + 2 + 2*m_uiShards;
+		lua_checkstack(ptL, 2*m_uiShards + 4);
+		for(uiShard=0; uiShard<2*m_uiShards; ++uiShard)
+		{
+			lua_newtable(ptL);
+		}
+		lua_newtable(ptL);
+
+		for(sizCnt=1; sizCnt<=sizElements; ++sizCnt)
+		{
+			lua_rawgeti(ptL, iTop+1, (int)sizCnt);
+			pcKey = NULL;
+			sizKey = 0;
+			if( lua_type(ptL, -1)==LUA_TTABLE )
+			{
+				lua_getfield(ptL, -1, "key");
+				if( lua_type(ptL, -1)==LUA_TSTRING )
+				{
+					pcKey = lua_tolstring(ptL, -1, &sizKey);
+				}
+				uiShard = getShard(pcKey, sizKey);
+				lua_pop(ptL, 1);
+			}
+			else
+			{
+				uiShard = getShard(NULL, 0);
+			}
+
+			++psizShardElements[uiShard];
+			lua_rawseti(ptL, iMessagesIndex+uiShard, (int)psizShardElements[uiShard]);
+#if LUA_VERSION_NUM>=504
+			lua_pushinteger(ptL, (lua_Integer)sizCnt);
+#else
+			lua_pushnumber(ptL, (lua_Number)sizCnt);
+#endif
+			lua_rawseti(ptL, iIndicesIndex+uiShard, (int)psizShardElements[uiShard]);
+		}
+
+		/* Send the batch of each shard and collect the results. */
+		iAccepted = 0;
+		for(uiShard=0; uiShard<m_uiShards; ++uiShard)
+		{
+			if( psizShardElements[uiShard]!=0 )
+			{
+				lua_pushvalue(ptL, iMessagesIndex+uiShard);
+				lua_replace(ptL, iTableIndex);
+
+				/* This pushes the number of accepted messages and the
+				 * error table.
+				 */
+				m_pptTopics[uiShard]->send_batch(ptL, ptL, iPartition);
+				iAccepted += (int)lua_tointeger(ptL, -2);
+
+				/* Translate the indices of the errors. */
+				lua_pushnil(ptL);
+				while( lua_next(ptL, -2)!=0 )
+				{
+					iIndex = (int)lua_tointeger(ptL, -2);
+					lua_rawgeti(ptL, iIndicesIndex+uiShard, iIndex);
+					lua_pushvalue(ptL, -2);
+					lua_rawset(ptL, iErrorsIndex);
+					lua_pop(ptL, 1);
+				}
+				lua_pop(ptL, 2);
+			}
+		}
+		free(psizShardElements);
+
+		/* Restore the original table. */
+		lua_pushvalue(ptL, iTop+1);
+		lua_replace(ptL, iTableIndex);
+
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(ptL, iAccepted);
+#else
+		lua_pushnumber(ptL, iAccepted);
+#endif
+		lua_pushvalue(ptL, iErrorsIndex);
+	}
+}
+
+
+
+void ShardedTopic::set_zero_copy(bool fZeroCopy, unsigned int uiMinimumSize)
+{
+	unsigned int uiCnt;
+
+
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		m_pptTopics[uiCnt]->set_zero_copy(fZeroCopy, uiMinimumSize);
+	}
+}
+
+
+
+void ShardedTopic::set_send_timeout(int iTimeout)
+{
+	unsigned int uiCnt;
+
+
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		m_pptTopics[uiCnt]->set_send_timeout(iTimeout);
+	}
+}
+
+
+
+/* Return the sum of the delivery counters of all shards. There is no
+ * "last_acked" field as each shard counts its own sequence numbers.
+ */
+void ShardedTopic::get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	KAFKA_DELIVERY_STATISTICS_T tSum;
+	const KAFKA_DELIVERY_STATISTICS_T *ptStatistics;
+	unsigned int uiCnt;
+
+
+	memset(&tSum, 0, sizeof(KAFKA_DELIVERY_STATISTICS_T));
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		ptStatistics = m_pptTopics[uiCnt]->_getDeliveryStatistics();
+		if( ptStatistics!=NULL )
+		{
+			tSum.ullDelivered += ptStatistics->ullDelivered;
+			tSum.ullFailed += ptStatistics->ullFailed;
+			tSum.ullBytes += ptStatistics->ullBytes;
+		}
+	}
+	kafka_push_delivery_statistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, &tSum);
+}
+
+
+
+const char *ShardedTopic::error2string(int iError)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = (rd_kafka_resp_err_t)iError;
+	return rd_kafka_err2str(tError);
+}
+
+
+
+/*--------------------------------------------------------------------------*/
+
+/* Create a producer with uiShards librdkafka handles. All handles get the
+ * same broker list and config.
+ */
+ShardedProducer::ShardedProducer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, unsigned int uiShards, lua_State *ptLuaStateForTableAccessOptional)
+ : m_pptCores(NULL)
+ , m_uiShards(0)
+{
+	unsigned int uiCnt;
+	RdKafkaCore *ptCore;
+
+
+	if( uiShards==0 )
+	{
+		luaL_error(MUHKUH_LUA_STATE, "A sharded producer needs at least one shard.");
+	}
+
+	m_pptCores = (RdKafkaCore**)malloc(uiShards * sizeof(RdKafkaCore*));
+	if( m_pptCores==NULL )
+	{
+		luaL_error(MUHKUH_LUA_STATE, "Failed to allocate %d shards.", uiShards);
+	}
+
+	/* Count the cores as they are created. The destructor only releases
+	 * the complete ones.
+	 */
+	for(uiCnt=0; uiCnt<uiShards; ++uiCnt)
+	{
+		ptCore = new RdKafkaCore();
+		ptCore->createCore(RD_KAFKA_PRODUCER, pcBrokerList, NULL, MUHKUH_LUA_STATE, ptLuaStateForTableAccessOptional, 3);
+		ptCore->reference();
+		ptCore->setShard(uiCnt + 1);
+		m_pptCores[uiCnt] = ptCore;
+		m_uiShards = uiCnt + 1;
+	}
+
+	printf("ShardedProducer(%p) created with %d shards.\n", this, m_uiShards);
+}
+
+
+
+ShardedProducer::~ShardedProducer(void)
+{
+	unsigned int uiCnt;
+
+
+	if( m_pptCores!=NULL )
+	{
+		for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+		{
+			m_pptCores[uiCnt]->dereference();
+		}
+		free(m_pptCores);
+		m_pptCores = NULL;
+	}
+	m_uiShards = 0;
+
+	printf("ShardedProducer(%p) deleted.\n", this);
+}
+
+
+
+int ShardedProducer::shards(void)
+{
+	return (int)m_uiShards;
+}
+
+
+
+/* Poll all shards and return the number of failed messages. Each shard is
+ * polled without waiting, so a slow shard can not block the others. This
+ * is repeated until one shard served an event or the timeout is over. A
+ * negative timeout waits forever like rd_kafka_poll.
+ */
+int ShardedProducer::poll(lua_State *MUHKUH_LUA_STATE, int iTimeout)
+{
+	unsigned int uiCnt;
+	void *pvMsgOpaque;
+	unsigned int uiFailures;
+	unsigned int uiFailuresSum;
+	int iEvents;
+	uint64_t ullStart;
+	bool fDone;
+
+
+	uiFailuresSum = 0;
+	ullStart = kafka_get_time_ms();
+	do
+	{
+		iEvents = 0;
+		for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+		{
+			iEvents += m_pptCores[uiCnt]->poll(MUHKUH_LUA_STATE, 0, &pvMsgOpaque, &uiFailures);
+			uiFailuresSum += uiFailures;
+		}
+
+		fDone = true;
+		if( iEvents==0 && (iTimeout<0 || (kafka_get_time_ms()-ullStart)<(uint64_t)iTimeout) )
+		{
+			kafka_sleep_ms(1);
+			fDone = false;
+		}
+	} while( fDone==false );
+
+	return (int)uiFailuresSum;
+}
+
+
+
+/* Set a LUA function which is called from poll with a table of delivery
+ * reports. It is called once for each shard with reports. Each shard counts
+ * its own sequence numbers, so the reports have the number of their shard
+ * in the field "shard", starting at 1. Pass nil to remove the callback.
+ */
+void ShardedProducer::set_delivery_callback(lua_State *MUHKUH_LUA_STATE, int iLUA_INDEX_OPTIONAL)
+{
+	unsigned int uiCnt;
+
+
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		m_pptCores[uiCnt]->setDeliveryCallback(MUHKUH_LUA_STATE, iLUA_INDEX_OPTIONAL, NULL);
+	}
+}
+
+
+
+/* Flush all shards. The timeout is for all shards together. */
+int ShardedProducer::flush(int iTimeout)
+{
+	unsigned int uiCnt;
+	uint64_t ullStart;
+	uint64_t ullElapsed;
+	int iRemaining;
+	int iResult;
+
+
+	iResult = 0;
+	ullStart = kafka_get_time_ms();
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		iRemaining = iTimeout;
+		if( iTimeout>0 )
+		{
+			ullElapsed = kafka_get_time_ms() - ullStart;
+			iRemaining = 0;
+			if( ullElapsed<(uint64_t)iTimeout )
+			{
+				iRemaining = iTimeout - (int)ullElapsed;
+			}
+		}
+
+		iResult = m_pptCores[uiCnt]->flush(iRemaining);
+		if( iResult!=0 )
+		{
+			break;
+		}
+	}
+
+	return iResult;
+}
+
+
+
+/* Return the sum of the delivery counters of all shards. */
+void ShardedProducer::get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	KAFKA_DELIVERY_STATISTICS_T tSum;
+	const KAFKA_DELIVERY_STATISTICS_T *ptStatistics;
+	unsigned int uiCnt;
+
+
+	memset(&tSum, 0, sizeof(KAFKA_DELIVERY_STATISTICS_T));
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		ptStatistics = m_pptCores[uiCnt]->getDeliveryStatistics();
+		tSum.ullDelivered += ptStatistics->ullDelivered;
+		tSum.ullFailed += ptStatistics->ullFailed;
+		tSum.ullBytes += ptStatistics->ullBytes;
+	}
+	kafka_push_delivery_statistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, &tSum);
+}
+
+
+
+/* Return an array with the statistics summary of each shard. A shard has
+ * no entry if it has no statistics yet.
+ */
+void ShardedProducer::get_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	unsigned int uiCnt;
+
+
+	lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_uiShards, 0);
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		m_pptCores[uiCnt]->pushStatistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+		lua_rawseti(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, uiCnt+1);
+	}
+}
+
+
+
+/* Poll each shard in its own native thread. */
+int ShardedProducer::start_background_poll(unsigned int uiRingSize)
+{
+	unsigned int uiCnt;
+	int iResult;
+
+
+	iResult = 0;
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		iResult = m_pptCores[uiCnt]->startBackgroundPoll(uiRingSize);
+		if( iResult!=0 )
+		{
+			break;
+		}
+	}
+
+	return iResult;
+}
+
+
+
+void ShardedProducer::stop_background_poll(void)
+{
+	unsigned int uiCnt;
+
+
+	for(uiCnt=0; uiCnt<m_uiShards; ++uiCnt)
+	{
+		m_pptCores[uiCnt]->stopBackgroundPoll();
+	}
+}
+
+
+
+const char *ShardedProducer::error2string(int iError)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = (rd_kafka_resp_err_t)iError;
+	return rd_kafka_err2str(tError);
+}
+
+
+
+ShardedTopic *ShardedProducer::create_topic(lua_State *MUHKUH_LUA_STATE, const char *pcTopic, lua_State *ptLuaStateForTableAccessOptional)
+{
+	ShardedTopic *ptTopic;
+
+
+	ptTopic = new ShardedTopic(m_pptCores, m_uiShards, MUHKUH_LUA_STATE, pcTopic, ptLuaStateForTableAccessOptional, 3);
+	return ptTopic;
+}
+
+
+
+/*--------------------------------------------------------------------------*/
+
+/* The message holds a reference to the core. A message must be destroyed
+ * before the handle.
+ */
+Message::Message(RdKafkaCore *ptCore, rd_kafka_message_t *ptRkMessage)
+ : m_ptCore(ptCore)
+ , m_ptRkMessage(ptRkMessage)
+{
+	m_ptCore->reference();
+}
+
+
+
+Message::~Message(void)
+{
+	release();
+
+	if( m_ptCore!=NULL )
+	{
+		m_ptCore->dereference();
+		m_ptCore = NULL;
+	}
+}
+
+
+
+/* Return the complete payload as a string or nil if there is no payload. */
+void Message::value(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	if( m_ptRkMessage==NULL || m_ptRkMessage->payload==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lua_pushlstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (const char*)(m_ptRkMessage->payload), m_ptRkMessage->len);
+	}
+}
+
+
+
+void Message::key(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	if( m_ptRkMessage==NULL || m_ptRkMessage->key==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lua_pushlstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (const char*)(m_ptRkMessage->key), m_ptRkMessage->key_len);
+	}
+}
+
+
+
+int Message::len(void)
+{
+	int iLength;
+
+
+	iLength = 0;
+	if( m_ptRkMessage!=NULL && m_ptRkMessage->payload!=NULL )
+	{
+		iLength = (int)(m_ptRkMessage->len);
+	}
+
+	return iLength;
+}
+
+
+
+/* Return a part of the payload. The indices work like the ones of
+ * "string.sub": they start at 1 and negative values count from the end.
+ */
+void Message::sub(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, long lStart, long lEnd)
+{
+	long lLength;
+
+
+	if( m_ptRkMessage==NULL || m_ptRkMessage->payload==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lLength = (long)(m_ptRkMessage->len);
+		if( lStart<0 )
+		{
+			lStart += lLength + 1;
+		}
+		if( lStart<1 )
+		{
+			lStart = 1;
+		}
+		if( lEnd<0 )
+		{
+			lEnd += lLength + 1;
+		}
+		if( lEnd>lLength )
+		{
+			lEnd = lLength;
+		}
+
+		if( lStart>lEnd )
+		{
+			lua_pushstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, "");
+		}
+		else
+		{
+			lua_pushlstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, ((const char*)(m_ptRkMessage->payload))+lStart-1, (size_t)(lEnd-lStart+1));
+		}
+	}
+}
+
+
+
+/* Return the value of the last header with the name or nil. */
+void Message::header(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, const char *pcName)
+{
+	rd_kafka_resp_err_t tError;
+	rd_kafka_headers_t *ptHeaders;
+	const void *pvValue;
+	size_t sizValue;
+
+
+	tError = RD_KAFKA_RESP_ERR__NOENT;
+	pvValue = NULL;
+	sizValue = 0;
+	if( m_ptRkMessage!=NULL )
+	{
+		tError = rd_kafka_message_headers(m_ptRkMessage, &ptHeaders);
+		if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			tError = rd_kafka_header_get_last(ptHeaders, pcName, &pvValue, &sizValue);
+		}
+	}
+
+	if( tError!=RD_KAFKA_RESP_ERR_NO_ERROR || pvValue==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lua_pushlstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (const char*)pvValue, sizValue);
+	}
+}
+
+
+
+/* Return all headers as a table with the names as keys. If a name appears
+ * more than once, the last value wins. Headers without a value are set to
+ * "false".
+ */
+void Message::headers(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	rd_kafka_resp_err_t tError;
+	rd_kafka_headers_t *ptHeaders;
+	size_t sizCnt;
+	const char *pcName;
+	const void *pvValue;
+	size_t sizValue;
+
+
+	ptHeaders = NULL;
+	if( m_ptRkMessage!=NULL )
+	{
+		tError = rd_kafka_message_headers(m_ptRkMessage, &ptHeaders);
+		if( tError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			ptHeaders = NULL;
+		}
+	}
+
+	if( ptHeaders==NULL )
+	{
+		lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0, 0);
+	}
+	else
+	{
+		lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0, (int)rd_kafka_header_cnt(ptHeaders));
+		sizCnt = 0;
+		while( rd_kafka_header_get_all(ptHeaders, sizCnt, &pcName, &pvValue, &sizValue)==RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			if( pvValue==NULL )
+			{
+				lua_pushboolean(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0);
+			}
+			else
+			{
+				lua_pushlstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (const char*)pvValue, sizValue);
+			}
+			lua_setfield(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, -2, pcName);
+			++sizCnt;
+		}
+	}
+}
+
+
+
+void Message::offset(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	if( m_ptRkMessage==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (lua_Integer)(m_ptRkMessage->offset));
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (lua_Number)(m_ptRkMessage->offset));
+#endif
+	}
+}
+
+
+
+int Message::partition(void)
+{
+	int iPartition;
+
+
+	iPartition = RD_KAFKA_PARTITION_UA;
+	if( m_ptRkMessage!=NULL )
+	{
+		iPartition = m_ptRkMessage->partition;
+	}
+
+	return iPartition;
+}
+
+
+
+void Message::topic(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	if( m_ptRkMessage==NULL || m_ptRkMessage->rkt==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lua_pushstring(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, rd_kafka_topic_name(m_ptRkMessage->rkt));
+	}
+}
+
+
+
+void Message::timestamp(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	int64_t llTimestamp;
+	rd_kafka_timestamp_type_t tTimestampType;
+
+
+	tTimestampType = RD_KAFKA_TIMESTAMP_NOT_AVAILABLE;
+	llTimestamp = 0;
+	if( m_ptRkMessage!=NULL )
+	{
+		llTimestamp = rd_kafka_message_timestamp(m_ptRkMessage, &tTimestampType);
+	}
+
+	if( tTimestampType==RD_KAFKA_TIMESTAMP_NOT_AVAILABLE )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (lua_Integer)llTimestamp);
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, (lua_Number)llTimestamp);
+#endif
+	}
+}
+
+
+
+/* Return the error code of the message or nil for a valid message. */
+void Message::error(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	if( m_ptRkMessage==NULL || m_ptRkMessage->err==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_ptRkMessage->err);
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, m_ptRkMessage->err);
+#endif
+	}
+}
+
+
+
+/* Free the librdkafka buffer before the garbage collector gets to the
+ * object. All accessors return nil after this.
+ */
+void Message::release(void)
+{
+	if( m_ptRkMessage!=NULL )
+	{
+		rd_kafka_message_destroy(m_ptRkMessage);
+		m_ptRkMessage = NULL;
+	}
+}
 
-  char errstr[512];
-  lua_pushnil(lua);
-  while (lua_next(lua, idx) != 0) {
-    int kt = lua_type(lua, -2);
-    int vt = lua_type(lua, -1);
-    switch (kt) {
-    case LUA_TSTRING:
-      switch (vt) {
-      case LUA_TSTRING:
-        {
-          const char *key = lua_tostring(lua, -2);
-          const char *value = lua_tostring(lua, -1);
-          if (value) {
-            rd_kafka_conf_res_t r;
-            r = rd_kafka_conf_set(conf, key, value, errstr, sizeof errstr);
-            if (r) {
-              printf("Failed to set %s = %s : %s", key, value,
-                              errstr);
-              return -1;
-            }
-          }
-        }
-        break;
-      case LUA_TNUMBER:
-        {
-          const char *key = lua_tostring(lua, -2);
-          int i = (int)lua_tointeger(lua, -1);
-          char value[12];
-          snprintf(value, sizeof value, "%d", i);
-          rd_kafka_conf_res_t r;
-          r = rd_kafka_conf_set(conf, key, value, errstr, sizeof errstr);
-          if (r) {
-            printf("Failed to set %s = %s : %s", key, value,
-                            errstr);
-            return -1;
-          }
-        }
-        break;
-      case LUA_TBOOLEAN:
-        {
-          const char *key = lua_tostring(lua, -2);
-          const char *value = "false";
-          if (lua_toboolean(lua, -1)) {
-            value = "true";
-          }
-          rd_kafka_conf_res_t r;
-          r = rd_kafka_conf_set(conf, key, value, errstr, sizeof errstr);
-          if (r) {
-            printf("Failed to set %s = %s : %s", key, value,
-                            errstr);
-            return -1;
-          }
-        }
-        break;
-      default:
-        printf("invalid config value type: %s",
-                        lua_typename(lua, vt));
-        return -1;
-      }
-      break;
-    default:
-      printf("invalid config key type: %s",
-                      lua_typename(lua, kt));
-      return -1;
-    }
-    lua_pop(lua, 1);
-  }
-  return 0;
+
+
+const rd_kafka_message_t *Message::_getRkMessage(void)
+{
+	return m_ptRkMessage;
+}
+
+
+
+/*--------------------------------------------------------------------------*/
+
+Consumer::Consumer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, const char *pcGroupId, lua_State *ptLuaStateForTableAccessOptional)
+ : m_ptCore(NULL)
+ , m_ptRk(NULL)
+ , m_ptQueue(NULL)
+ , m_ptPendingOffsets(NULL)
+ , m_ptCommitQueue(NULL)
+ , m_ptPollLuaState(NULL)
+ , m_uiCommitsInFlight(0)
+ , m_pptBatchMessages(NULL)
+ , m_sizBatchMax(0)
+{
+	/* Create a new core. */
+	m_ptCore = new RdKafkaCore();
+	if( m_ptCore!=NULL )
+	{
+		m_ptCore->createCore(RD_KAFKA_CONSUMER, pcBrokerList, pcGroupId, MUHKUH_LUA_STATE, ptLuaStateForTableAccessOptional, 3);
+		m_ptCore->reference();
+		m_ptRk = m_ptCore->_getRk();
+
+		/* Get the consumer queue for the batch functions. There is no
+		 * queue without a group. The group ID can come from the argument
+		 * or from "group.id" in the configuration table.
+		 */
+		m_ptQueue = rd_kafka_queue_get_consumer(m_ptRk);
+		if( m_ptQueue==NULL )
+		{
+			m_ptCore->dereference();
+			m_ptCore = NULL;
+			m_ptRk = NULL;
+			luaL_error(MUHKUH_LUA_STATE, "The consumer needs a group ID.");
+		}
+
+		m_ptPendingOffsets = rd_kafka_topic_partition_list_new(16);
+		m_ptCommitQueue = rd_kafka_queue_new(m_ptRk);
+	}
+}
+
+
+
+Consumer::~Consumer(void)
+{
+	if( m_pptBatchMessages!=NULL )
+	{
+		free(m_pptBatchMessages);
+		m_pptBatchMessages = NULL;
+	}
+	m_sizBatchMax = 0;
+
+	/* Commit all offsets which were stored after the last commit. Wait for
+	 * the result as this is the last chance.
+	 */
+	if( m_ptPendingOffsets!=NULL )
+	{
+		if( m_ptPendingOffsets->cnt!=0 )
+		{
+			rd_kafka_commit(m_ptRk, m_ptPendingOffsets, 0);
+		}
+		rd_kafka_topic_partition_list_destroy(m_ptPendingOffsets);
+		m_ptPendingOffsets = NULL;
+	}
+
+	/* The queues must be released before the handle is destroyed. */
+	if( m_ptCommitQueue!=NULL )
+	{
+		rd_kafka_queue_io_event_enable(m_ptCommitQueue, -1, NULL, 0);
+		rd_kafka_queue_destroy(m_ptCommitQueue);
+		m_ptCommitQueue = NULL;
+	}
+	if( m_ptQueue!=NULL )
+	{
+		rd_kafka_queue_destroy(m_ptQueue);
+		m_ptQueue = NULL;
+	}
+
+	if( m_ptCore!=NULL )
+	{
+		m_ptCore->dereference();
+		m_ptCore = NULL;
+	}
+}
+
+
+
+/* Subscribe to a list of topics. The argument is an array of topic names. */
+int Consumer::subscribe(lua_State *ptLuaStateForTableAccess)
+{
+	rd_kafka_topic_partition_list_t *ptTopics;
+	rd_kafka_resp_err_t tError;
+	size_t sizTopics;
+	size_t sizCnt;
+	const char *pcTopic;
+
+
+#if LUA_VERSION_NUM>=502
+	sizTopics = lua_rawlen(ptLuaStateForTableAccess, 2);
+#else
+	sizTopics = lua_objlen(ptLuaStateForTableAccess, 2);
+#endif
+
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+	ptTopics = rd_kafka_topic_partition_list_new((int)sizTopics);
+	for(sizCnt=1; sizCnt<=sizTopics; ++sizCnt)
+	{
+		lua_rawgeti(ptLuaStateForTableAccess, 2, sizCnt);
+		if( lua_type(ptLuaStateForTableAccess, -1)!=LUA_TSTRING )
+		{
+			tError = RD_KAFKA_RESP_ERR__INVALID_ARG;
+		}
+		else
+		{
+			pcTopic = lua_tostring(ptLuaStateForTableAccess, -1);
+			rd_kafka_topic_partition_list_add(ptTopics, pcTopic, RD_KAFKA_PARTITION_UA);
+		}
+		lua_pop(ptLuaStateForTableAccess, 1);
+	}
+
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		tError = rd_kafka_subscribe(m_ptRk, ptTopics);
+	}
+	rd_kafka_topic_partition_list_destroy(ptTopics);
+
+	return (int)tError;
+}
+
+
+
+int Consumer::unsubscribe(void)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = rd_kafka_unsubscribe(m_ptRk);
+	return (int)tError;
+}
+
+
+
+/* Assign a list of partitions. The argument is an array of tables with the
+ * fields "topic", "partition" and "offset". The offset is optional, the
+ * default is the stored offset.
+ */
+int Consumer::assign(lua_State *ptLuaStateForTableAccess)
+{
+	rd_kafka_topic_partition_list_t *ptPartitions;
+	rd_kafka_topic_partition_t *ptPartition;
+	rd_kafka_resp_err_t tError;
+	size_t sizPartitions;
+	size_t sizCnt;
+	const char *pcTopic;
+	int32_t iPartition;
+	int64_t llOffset;
+
+
+#if LUA_VERSION_NUM>=502
+	sizPartitions = lua_rawlen(ptLuaStateForTableAccess, 2);
+#else
+	sizPartitions = lua_objlen(ptLuaStateForTableAccess, 2);
+#endif
+
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+	ptPartitions = rd_kafka_topic_partition_list_new((int)sizPartitions);
+	for(sizCnt=1; sizCnt<=sizPartitions; ++sizCnt)
+	{
+		lua_rawgeti(ptLuaStateForTableAccess, 2, sizCnt);
+		if( lua_type(ptLuaStateForTableAccess, -1)!=LUA_TTABLE )
+		{
+			tError = RD_KAFKA_RESP_ERR__INVALID_ARG;
+		}
+		else
+		{
+			lua_getfield(ptLuaStateForTableAccess, -1, "topic");
+			lua_getfield(ptLuaStateForTableAccess, -2, "partition");
+			lua_getfield(ptLuaStateForTableAccess, -3, "offset");
+			if( lua_type(ptLuaStateForTableAccess, -3)!=LUA_TSTRING || lua_type(ptLuaStateForTableAccess, -2)!=LUA_TNUMBER )
+			{
+				tError = RD_KAFKA_RESP_ERR__INVALID_ARG;
+			}
+			else
+			{
+				pcTopic = lua_tostring(ptLuaStateForTableAccess, -3);
+				iPartition = (int32_t)lua_tointeger(ptLuaStateForTableAccess, -2);
+				llOffset = RD_KAFKA_OFFSET_STORED;
+				if( lua_type(ptLuaStateForTableAccess, -1)==LUA_TNUMBER )
+				{
+					llOffset = (int64_t)lua_tointeger(ptLuaStateForTableAccess, -1);
+				}
+				ptPartition = rd_kafka_topic_partition_list_add(ptPartitions, pcTopic, iPartition);
+				ptPartition->offset = llOffset;
+			}
+			lua_pop(ptLuaStateForTableAccess, 3);
+		}
+		lua_pop(ptLuaStateForTableAccess, 1);
+	}
+
+	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	{
+		tError = rd_kafka_assign(m_ptRk, ptPartitions);
+	}
+	rd_kafka_topic_partition_list_destroy(ptPartitions);
+
+	return (int)tError;
+}
+
+
+
+/* Wait up to iTimeout milliseconds for a message. This returns a table with
+ * the fields "value", "key", "topic", "partition", "offset", "timestamp" and
+ * "error" or nil if no message arrived. The "error" field is only set for
+ * error events like the end of a partition.
+ */
+void Consumer::consume(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout)
+{
+	rd_kafka_message_t *ptRkMessage;
+
+
+	m_ptCore->drainEventFd();
+	ptRkMessage = rd_kafka_consumer_poll(m_ptRk, iTimeout);
+	if( ptRkMessage==NULL )
+	{
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	}
+	else
+	{
+		lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0, 7);
+		kafka_fill_message_table(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, ptRkMessage);
+		rd_kafka_message_destroy(ptRkMessage);
+	}
+}
+
+
+
+/* Wait up to iTimeout milliseconds for messages and return up to
+ * uiMaxMessages of them in one call. The messages are written to the array
+ * part of the table. Existing message tables in the array are reused, all
+ * entries after the last message are set to nil. This returns the number of
+ * messages.
+ */
+int Consumer::consume_batch(unsigned int uiMaxMessages, int iTimeout, lua_State *ptLuaStateForTableAccess)
+{
+	rd_kafka_message_t **pptMessages;
+	rd_kafka_message_t *ptRkMessage;
+	ssize_t ssizMessages;
+	size_t sizMessages;
+	size_t sizCnt;
+	size_t sizOldEntries;
+
+
+	sizMessages = 0;
+
+	/* Grow the message buffer if necessary. */
+	pptMessages = m_pptBatchMessages;
+	if( uiMaxMessages>m_sizBatchMax )
+	{
+		pptMessages = (rd_kafka_message_t**)realloc(m_pptBatchMessages, uiMaxMessages*sizeof(rd_kafka_message_t*));
+		if( pptMessages==NULL )
+		{
+			luaL_error(ptLuaStateForTableAccess, "Failed to allocate the batch buffer for %d messages.", (int)uiMaxMessages);
+		}
+		m_pptBatchMessages = pptMessages;
+		m_sizBatchMax = uiMaxMessages;
+	}
+
+	m_ptCore->drainEventFd();
+	if( pptMessages!=NULL && uiMaxMessages!=0 )
+	{
+		ssizMessages = rd_kafka_consume_batch_queue(m_ptQueue, iTimeout, pptMessages, uiMaxMessages);
+		if( ssizMessages>0 )
+		{
+			sizMessages = (size_t)ssizMessages;
+		}
+	}
+
+	for(sizCnt=0; sizCnt<sizMessages; ++sizCnt)
+	{
+		ptRkMessage = pptMessages[sizCnt];
+
+		/* Reuse the old message table if there is one. */
+		lua_rawgeti(ptLuaStateForTableAccess, 4, sizCnt+1);
+		if( lua_type(ptLuaStateForTableAccess, -1)!=LUA_TTABLE )
+		{
+			lua_pop(ptLuaStateForTableAccess, 1);
+			lua_createtable(ptLuaStateForTableAccess, 0, 7);
+			lua_pushvalue(ptLuaStateForTableAccess, -1);
+			lua_rawseti(ptLuaStateForTableAccess, 4, sizCnt+1);
+		}
+		kafka_fill_message_table(ptLuaStateForTableAccess, ptRkMessage);
+		lua_pop(ptLuaStateForTableAccess, 1);
+
+		rd_kafka_message_destroy(ptRkMessage);
+	}
+
+	/* Remove the surplus entries of the last batch. */
+#if LUA_VERSION_NUM>=502
+	sizOldEntries = lua_rawlen(ptLuaStateForTableAccess, 4);
+#else
+	sizOldEntries = lua_objlen(ptLuaStateForTableAccess, 4);
+#endif
+	while( sizOldEntries>sizMessages )
+	{
+		lua_pushnil(ptLuaStateForTableAccess);
+		lua_rawseti(ptLuaStateForTableAccess, 4, sizOldEntries);
+		--sizOldEntries;
+	}
+
+	return (int)sizMessages;
+}
+
+
+
+/* Wait up to iTimeout milliseconds for a message. This returns a Message
+ * object or nil if no message arrived. In contrast to "consume" the payload
+ * is not copied.
+ */
+Message *Consumer::consume_view(int iTimeout)
+{
+	rd_kafka_message_t *ptRkMessage;
+	Message *ptMessage;
+
+
+	ptMessage = NULL;
+	m_ptCore->drainEventFd();
+	ptRkMessage = rd_kafka_consumer_poll(m_ptRk, iTimeout);
+	if( ptRkMessage!=NULL )
+	{
+		ptMessage = new Message(m_ptCore, ptRkMessage);
+	}
+
+	return ptMessage;
+}
+
+
+
+/* Mark a message as processed. The offset is only written to the pending
+ * list, it is sent to the broker with the next "commit_async".
+ */
+int Consumer::store_offset(Message *ptMessage)
+{
+	const rd_kafka_message_t *ptRkMessage;
+	rd_kafka_resp_err_t tError;
+
+
+	tError = RD_KAFKA_RESP_ERR__INVALID_ARG;
+	if( ptMessage!=NULL )
+	{
+		ptRkMessage = ptMessage->_getRkMessage();
+		if( ptRkMessage==NULL )
+		{
+			/* The message was already released. */
+			tError = RD_KAFKA_RESP_ERR__STATE;
+		}
+		else if( ptRkMessage->rkt!=NULL )
+		{
+			tError = (rd_kafka_resp_err_t)store_offset(rd_kafka_topic_name(ptRkMessage->rkt), ptRkMessage->partition, ptRkMessage->offset);
+		}
+	}
+
+	return (int)tError;
 }
 
 
-/*--------------------------------------------------------------------------*/
 
-Topic::Topic(RdKafkaCore *ptCore, lua_State *ptLuaState, const char *pcTopic, lua_State *ptLuaStateForConfig, int iConfigTableIndex)
- : m_ptRk(NULL)
- , m_ptCore(NULL)
- , m_pcTopic(NULL)
- , m_ptTopic(NULL)
- , m_uiSequenceNr(0)
+/* Mark the message at llOffset in a partition as processed. The committed
+ * offset is the next message to read, which is llOffset+1. Several calls for
+ * the same partition are coalesced to one entry with the highest offset.
+ */
+int Consumer::store_offset(const char *pcTopic, int iPartition, int64_t llOffset)
 {
-	rd_kafka_topic_conf_t *ptConf;
-	int iResult;
-
-
-	m_ptRk = ptCore->_getRk();
+	rd_kafka_topic_partition_t *ptPartition;
+	rd_kafka_resp_err_t tError;
 
-	m_pcTopic = strdup(pcTopic);
 
-	ptConf = rd_kafka_topic_conf_new();
-	/* Add the pointer to this class to the topic instance. */
-	rd_kafka_topic_conf_set_opaque(ptConf, this);
-	/* Load the configuration from a LUA table (if available). */
-	if( ptLuaStateForConfig!=NULL )
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+	if( pcTopic==NULL || iPartition<0 || llOffset<0 )
 	{
-		iResult = load_topic_conf(ptLuaStateForConfig, ptConf, iConfigTableIndex);
-		if( iResult!=0 )
+		tError = RD_KAFKA_RESP_ERR__INVALID_ARG;
+	}
+	else
+	{
+		ptPartition = rd_kafka_topic_partition_list_find(m_ptPendingOffsets, pcTopic, iPartition);
+		if( ptPartition==NULL )
 		{
-			rd_kafka_topic_conf_destroy(ptConf);
-			lua_error(ptLuaState);
+			ptPartition = rd_kafka_topic_partition_list_add(m_ptPendingOffsets, pcTopic, iPartition);
+			ptPartition->offset = llOffset + 1;
+		}
+		else if( ptPartition->offset<=llOffset )
+		{
+			ptPartition->offset = llOffset + 1;
 		}
 	}
 
-	m_ptTopic = rd_kafka_topic_new(m_ptRk, pcTopic, ptConf);
-	if( m_ptTopic==NULL )
+	return (int)tError;
+}
+
+
+
+/* Send all pending offsets to the broker without waiting for the result.
+ * The result is returned by one of the following calls to "poll".
+ */
+int Consumer::commit_async(void)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = RD_KAFKA_RESP_ERR_NO_ERROR;
+	if( m_ptPendingOffsets->cnt!=0 )
 	{
-		rd_kafka_topic_conf_destroy(ptConf);
-		luaL_error(ptLuaState, "rd_kafka_topic_new failed");
+		tError = rd_kafka_commit_queue(m_ptRk, m_ptPendingOffsets, m_ptCommitQueue, Consumer::commitCallbackStatic, this);
+		if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+		{
+			++m_uiCommitsInFlight;
+
+			/* Start a new list. The old one was copied by librdkafka. */
+			rd_kafka_topic_partition_list_destroy(m_ptPendingOffsets);
+			m_ptPendingOffsets = rd_kafka_topic_partition_list_new(16);
+		}
 	}
 
-	m_ptCore = ptCore;
-	m_ptCore->reference();
+	return (int)tError;
 }
 
 
 
-Topic::~Topic(void)
+void Consumer::commitCallbackStatic(rd_kafka_t *ptRk, rd_kafka_resp_err_t tError, rd_kafka_topic_partition_list_t *ptOffsets, void *pvOpaque)
 {
-	if( m_ptTopic!=NULL )
-	{
-		rd_kafka_topic_destroy(m_ptTopic);
-	}
+	Consumer *ptConsumer;
 
-	if( m_pcTopic!=NULL )
-	{
-		free(m_pcTopic);
-		m_pcTopic = NULL;
-	}
 
-	if( m_ptCore!=NULL )
+	ptConsumer = (Consumer*)pvOpaque;
+	if( ptConsumer!=NULL )
 	{
-		m_ptCore->dereference();
+		ptConsumer->commitCallback(tError, ptOffsets);
 	}
 }
 
 
 
-int Topic::send(int iPartition, const char *pcMessage)
+/* Append the result of one commit to the table on the top of
+ * m_ptPollLuaState. Each partition gets one entry with the fields "topic",
+ * "partition", "offset" and "error".
+ */
+void Consumer::commitCallback(rd_kafka_resp_err_t tError, rd_kafka_topic_partition_list_t *ptOffsets)
 {
-	int iResult;
-	size_t sizMessage;
-	void *pvMessage;
-	void *pvOpaque;
-	rd_kafka_resp_err_t tError;
+	lua_State *ptLuaState;
+	rd_kafka_topic_partition_t *ptPartition;
+	rd_kafka_resp_err_t tPartitionError;
+	int iCnt;
+	size_t sizEntries;
 
 
-	/* Silently ignore NULL messages. */
-	if( pcMessage==NULL )
+	if( m_uiCommitsInFlight!=0 )
 	{
-		iResult = 0;
+		--m_uiCommitsInFlight;
 	}
-	else
+
+	ptLuaState = m_ptPollLuaState;
+	if( ptLuaState!=NULL && ptOffsets!=NULL )
 	{
-		/* Get the size of the message. */
-		sizMessage = strlen(pcMessage);
-		pvMessage = (void*)pcMessage;
+#if LUA_VERSION_NUM>=502
+		sizEntries = lua_rawlen(ptLuaState, -1);
+#else
+		sizEntries = lua_objlen(ptLuaState, -1);
+#endif
+		for(iCnt=0; iCnt<ptOffsets->cnt; ++iCnt)
+		{
+			ptPartition = ptOffsets->elems + iCnt;
+			tPartitionError = ptPartition->err;
+			if( tPartitionError==RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+				tPartitionError = tError;
+			}
 
-		/* Use the current sequence number for the new message.
-		 * Increase the sequence number counter.
-		 */
-		pvOpaque = (void*)(m_uiSequenceNr++);
-
-		tError = rd_kafka_producev(
-			/* Producer handle */
-			m_ptRk,
-			/* Topic object. */
-			RD_KAFKA_V_RKT(m_ptTopic),
-			/* Make a copy of the payload. */
-			RD_KAFKA_V_MSGFLAGS(RD_KAFKA_MSG_F_COPY),
-			/* Message value and length */
-			RD_KAFKA_V_VALUE(pvMessage, sizMessage),
-			/* Per-Message opaque, provided in
-			 * delivery report callback as
-			 * msg_opaque. */
-			RD_KAFKA_V_OPAQUE(pvOpaque),
-			/* End sentinel */
-			RD_KAFKA_V_END
-		);
-		iResult = (int)tError;
+			lua_createtable(ptLuaState, 0, 4);
+			lua_pushstring(ptLuaState, ptPartition->topic);
+			lua_setfield(ptLuaState, -2, "topic");
+#if LUA_VERSION_NUM>=504
+			lua_pushinteger(ptLuaState, ptPartition->partition);
+			lua_setfield(ptLuaState, -2, "partition");
+			lua_pushinteger(ptLuaState, (lua_Integer)(ptPartition->offset));
+			lua_setfield(ptLuaState, -2, "offset");
+			if( tPartitionError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+				lua_pushinteger(ptLuaState, tPartitionError);
+				lua_setfield(ptLuaState, -2, "error");
+			}
+#else
+			lua_pushnumber(ptLuaState, ptPartition->partition);
+			lua_setfield(ptLuaState, -2, "partition");
+			lua_pushnumber(ptLuaState, (lua_Number)(ptPartition->offset));
+			lua_setfield(ptLuaState, -2, "offset");
+			if( tPartitionError!=RD_KAFKA_RESP_ERR_NO_ERROR )
+			{
+				lua_pushnumber(ptLuaState, tPartitionError);
+				lua_setfield(ptLuaState, -2, "error");
+			}
+#endif
+			++sizEntries;
+			lua_rawseti(ptLuaState, -2, sizEntries);
+		}
 	}
-
-	return iResult;
 }
 
 
 
-void Topic::poll(uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout)
+/* Wait up to iTimeout milliseconds for the results of "commit_async". This
+ * returns a table with one entry per committed partition. The table is empty
+ * if no commit finished.
+ */
+void Consumer::poll(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout)
 {
-	void *pvMsgOpaque;
-	unsigned int uiFailures;
+	lua_createtable(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, 0, 0);
 
+	/* Do not block if no commit is waiting for a result. */
+	if( m_uiCommitsInFlight==0 )
+	{
+		iTimeout = 0;
+	}
 
-	m_ptCore->poll(iTimeout, &pvMsgOpaque, &uiFailures);
-
-	*puiUINT_OR_NIL = (uintptr_t)pvMsgOpaque;
-	*puiUINT_OUT = uiFailures;
+	m_ptCore->drainEventFd();
+	m_ptPollLuaState = MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT;
+	rd_kafka_queue_poll_callback(m_ptCommitQueue, iTimeout);
+	/* Collect all other results which are already there. */
+	while( rd_kafka_queue_poll_callback(m_ptCommitQueue, 0)!=0 )
+	{
+	}
+	m_ptPollLuaState = NULL;
 }
 
 
 
-void Topic::onMessage(const rd_kafka_message_t *ptRkMessage)
+/* Return a file descriptor for "select" or an event loop. It becomes
+ * readable if messages, errors or commit results are waiting. Call the
+ * consume functions and "poll" until they return nothing after each wakeup.
+ * This returns nil if the platform does not support it.
+ */
+void Consumer::get_event_fd(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
 {
-	rd_kafka_resp_err_t tError;
-	uintptr_t uiSequenceNr;
+	int iFd;
 
 
-	tError = ptRkMessage->err;
-	uiSequenceNr = (uintptr_t)(ptRkMessage->_private);
-	if( tError==RD_KAFKA_RESP_ERR_NO_ERROR )
+	iFd = m_ptCore->getEventFd();
+	if( iFd==-1 )
 	{
-		printf("Topic(%p): Message %" PRIuPTR " delivered.\n", this, uiSequenceNr);
+		lua_pushnil(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
 	}
 	else
 	{
-		printf("Topic(%p): Failed to deliver message %" PRIuPTR ": %s\n", this, uiSequenceNr, rd_kafka_err2str(tError));
+		/* The commit results arrive in their own queue. */
+		m_ptCore->enableQueueEvents(m_ptCommitQueue);
+#if LUA_VERSION_NUM>=504
+		lua_pushinteger(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iFd);
+#else
+		lua_pushnumber(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, iFd);
+#endif
 	}
 }
 
 
 
-const char *Topic::error2string(int iError)
+/* Return the most important values of the latest librdkafka statistics or
+ * nil. They are updated by the consume functions.
+ */
+void Consumer::get_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
 {
-	rd_kafka_resp_err_t tError;
+	m_ptCore->pushStatistics(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+}
 
 
-	tError = (rd_kafka_resp_err_t)iError;
-	return rd_kafka_err2str(tError);
+
+void Consumer::get_stats_json(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT)
+{
+	m_ptCore->pushStatisticsJson(MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
 }
 
 
 
-int Topic::load_topic_conf(lua_State *ptLua, rd_kafka_topic_conf_t *ptConf, int idx)
+rd_kafka_t *Consumer::_getRk(void)
 {
-  if (!ptConf) {
-    lua_pushstring(ptLua, "rd_kafka_topic_conf_new() failed");
-    return -1;
-  }
-  if (lua_isnil(ptLua, idx)) {
-    return 0;
-  }
+	return m_ptRk;
+}
 
-  char errstr[512];
-  lua_pushnil(ptLua);
-  while (lua_next(ptLua, idx) != 0) {
-    int kt = lua_type(ptLua, -2);
-    int vt = lua_type(ptLua, -1);
-    switch (kt) {
-    case LUA_TSTRING:
-      switch (vt) {
-      case LUA_TSTRING:
-        {
-          const char *key = lua_tostring(ptLua, -2);
-          const char *value = lua_tostring(ptLua, -1);
-          if (value) {
-            rd_kafka_conf_res_t r;
-            r = rd_kafka_topic_conf_set(ptConf, key, value, errstr,
-                                        sizeof errstr);
-            if (r) {
-              lua_pushfstring(ptLua, "Failed to set %s = %s : %s", key, value,
-                              errstr);
-              return -1;
-            }
-          }
-        }
-        break;
-      case LUA_TNUMBER:
-        {
-          const char *key = lua_tostring(ptLua, -2);
-          int i = (int)lua_tointeger(ptLua, -1);
-          char value[12];
-          snprintf(value, sizeof value, "%d", i);
-          rd_kafka_conf_res_t r;
-          r = rd_kafka_topic_conf_set(ptConf, key, value, errstr,
-                                      sizeof errstr);
-          if (r) {
-            lua_pushfstring(ptLua, "Failed to set %s = %s : %s", key, value,
-                            errstr);
-            return -1;
-          }
-        }
-        break;
-      case LUA_TBOOLEAN:
-        {
-          const char *key = lua_tostring(ptLua, -2);
-          const char *value = "false";
-          if (lua_toboolean(ptLua, -1)) {
-            value = "true";
-          }
-          rd_kafka_conf_res_t r;
-          r = rd_kafka_topic_conf_set(ptConf, key, value, errstr,
-                                      sizeof errstr);
-          if (r) {
-            lua_pushfstring(ptLua, "Failed to set %s = %s : %s", key, value,
-                            errstr);
-            return -1;
-          }
-        }
-        break;
-      default:
-        lua_pushfstring(ptLua, "invalid config value type: %s",
-                        lua_typename(ptLua, vt));
-        return -1;
-      }
-      break;
-    default:
-      lua_pushfstring(ptLua, "invalid config key type: %s",
-                      lua_typename(ptLua, kt));
-      return -1;
-    }
-    lua_pop(ptLua, 1);
-  }
-  return 0;
+
+
+rd_kafka_topic_partition_list_t *Consumer::_getPendingOffsets(void)
+{
+	return m_ptPendingOffsets;
+}
+
+
+
+/* Forget all stored offsets. This is used after they were committed by a
+ * transaction.
+ */
+void Consumer::_clearPendingOffsets(void)
+{
+	rd_kafka_topic_partition_list_destroy(m_ptPendingOffsets);
+	m_ptPendingOffsets = rd_kafka_topic_partition_list_new(16);
+}
+
+
+
+const char *Consumer::error2string(int iError)
+{
+	rd_kafka_resp_err_t tError;
+
+
+	tError = (rd_kafka_resp_err_t)iError;
+	return rd_kafka_err2str(tError);
 }
 
 
 
 /*--------------------------------------------------------------------------*/
 
-Producer::Producer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, lua_State *ptLuaStateForTableAccessOptional)
- : m_ptCore(NULL)
+MockCluster::MockCluster(lua_State *MUHKUH_LUA_STATE, unsigned int uiBrokers)
+ : m_ptRk(NULL)
+ , m_ptCluster(NULL)
 {
-	if( ptLuaStateForTableAccessOptional==NULL )
+	rd_kafka_conf_t *ptConf;
+	char acError[512];
+
+
+	ptConf = rd_kafka_conf_new();
+	if( ptConf==NULL )
 	{
-		printf("Producer(%p) created without config.\n", this);
+		luaL_error(MUHKUH_LUA_STATE, "Failed to create a new configuration.");
 	}
-	else
+
+	m_ptRk = rd_kafka_new(RD_KAFKA_PRODUCER, ptConf, acError, sizeof(acError));
+	if( m_ptRk==NULL )
 	{
-		printf("Producer(%p) created with config.\n", this);
+		rd_kafka_conf_destroy(ptConf);
+		luaL_error(MUHKUH_LUA_STATE, "rd_kafka_new failed: %s", acError);
 	}
 
-	/* Create a new core. */
-	m_ptCore = new RdKafkaCore();
-	if( m_ptCore!=NULL )
+	m_ptCluster = rd_kafka_mock_cluster_new(m_ptRk, (int)uiBrokers);
+	if( m_ptCluster==NULL )
 	{
-		m_ptCore->createCore(pcBrokerList, MUHKUH_LUA_STATE, ptLuaStateForTableAccessOptional, 2);
-		m_ptCore->reference();
+		rd_kafka_destroy(m_ptRk);
+		m_ptRk = NULL;
+		luaL_error(MUHKUH_LUA_STATE, "Failed to create a mock cluster with %d brokers.", uiBrokers);
 	}
 }
 
 
 
-Producer::~Producer(void)
+MockCluster::~MockCluster(void)
 {
-	if( m_ptCore!=NULL )
+	/* The cluster must be destroyed before its handle. */
+	if( m_ptCluster!=NULL )
 	{
-		m_ptCore->dereference();
-		m_ptCore = NULL;
+		rd_kafka_mock_cluster_destroy(m_ptCluster);
+		m_ptCluster = NULL;
 	}
 
-	printf("Producer(%p) deleted.\n", this);
+	if( m_ptRk!=NULL )
+	{
+		rd_kafka_destroy(m_ptRk);
+		m_ptRk = NULL;
+	}
 }
 
 
 
-void Producer::poll(uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout)
+const char *MockCluster::bootstrap_servers(void)
 {
-	void *pvMsgOpaque;
-	unsigned int uiFailures;
-
-
-	m_ptCore->poll(iTimeout, &pvMsgOpaque, &uiFailures);
-
-	*puiUINT_OR_NIL = (uintptr_t)pvMsgOpaque;
-	*puiUINT_OUT = uiFailures;
+	return rd_kafka_mock_cluster_bootstraps(m_ptCluster);
 }
 
 
 
-int Producer::flush(int iTimeout)
+int MockCluster::create_topic(const char *pcTopic, int iPartitions, int iReplicationFactor)
 {
-	int iResult;
+	rd_kafka_resp_err_t tError;
 
 
-	iResult = m_ptCore->flush(iTimeout);
-	return iResult;
+	tError = rd_kafka_mock_topic_create(m_ptCluster, pcTopic, iPartitions, iReplicationFactor);
+	return (int)tError;
 }
 
 
 
-const char *Producer::error2string(int iError)
+const char *MockCluster::error2string(int iError)
 {
 	rd_kafka_resp_err_t tError;
 
@@ -698,23 +6140,3 @@ const char *Producer::error2string(int iError)
 	tError = (rd_kafka_resp_err_t)iError;
 	return rd_kafka_err2str(tError);
 }
-
-
-
-Topic *Producer::create_topic(lua_State *MUHKUH_LUA_STATE, const char *pcTopic, lua_State *ptLuaStateForTableAccessOptional)
-{
-	Topic *ptTopic;
-
-
-	if( ptLuaStateForTableAccessOptional==NULL )
-	{
-		printf("Producer(%p) create_topic without config.\n", this);
-	}
-	else
-	{
-		printf("Producer(%p) create_topic with config.\n", this);
-	}
-
-	ptTopic = new Topic(m_ptCore, MUHKUH_LUA_STATE, pcTopic, ptLuaStateForTableAccessOptional, 3);
-	return ptTopic;
-}
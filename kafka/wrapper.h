@@ -1,4 +1,5 @@
 #include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,6 +12,10 @@ extern "C" {
 
 #include <stdint.h>
 
+#if !defined(_WIN32)
+#       include <pthread.h>
+#endif
+
 
 
 #ifndef SWIGRUNTIME
@@ -28,6 +33,8 @@ typedef int RESULT_INT_WITH_ERR;
 
 
 const char* version(void);
+const char* builtin_features(void);
+double monotonic_us(void);
 
 #ifndef SWIG
 void kafka_initialize_error_codes(lua_State *ptLuaState);
@@ -36,35 +43,323 @@ void kafka_initialize_error_codes(lua_State *ptLuaState);
 
 /* Do not wrap the core class, it can not be accessed directly from LUA. */
 #ifndef SWIG
+/* These are the delivery counters for a topic or a complete core. The last
+ * acked sequence number is only set for a topic, the sequence numbers are
+ * counted per topic name.
+ */
+typedef struct KAFKA_DELIVERY_STATISTICS_STRUCT
+{
+	uint64_t ullDelivered;
+	uint64_t ullFailed;
+	uint64_t ullBytes;
+	bool fHasAcked;
+	uintptr_t uiLastAckedSequenceNr;
+} KAFKA_DELIVERY_STATISTICS_T;
+
+
+/* This is a histogram of the produce latency in microseconds. The buckets
+ * are logarithmic: each power of 2 is split into 32 linear sub-buckets. This
+ * keeps the error of a percentile below about 3%. Values below 32us get
+ * their own bucket. The last bucket is for values with up to 40 bits
+ * (about 12 days).
+ */
+#define KAFKA_LATENCY_SUB_BUCKET_BITS 5
+#define KAFKA_LATENCY_SUB_BUCKETS (1U<<KAFKA_LATENCY_SUB_BUCKET_BITS)
+#define KAFKA_LATENCY_MAX_BITS 40
+#define KAFKA_LATENCY_BUCKETS (KAFKA_LATENCY_SUB_BUCKETS + (KAFKA_LATENCY_MAX_BITS-KAFKA_LATENCY_SUB_BUCKET_BITS)*KAFKA_LATENCY_SUB_BUCKETS)
+
+typedef struct KAFKA_LATENCY_HISTOGRAM_STRUCT
+{
+	uint64_t ullCount;
+	uint64_t ullSum;
+	uint64_t ullMin;
+	uint64_t ullMax;
+	uint64_t aullBuckets[KAFKA_LATENCY_BUCKETS];
+} KAFKA_LATENCY_HISTOGRAM_T;
+
+
+/* This is a librdkafka handle for a topic with one config. It belongs to
+ * the core and is shared by all Topic objects with the same name and config.
+ */
+typedef struct KAFKA_TOPIC_HANDLE_STRUCT
+{
+	struct KAFKA_TOPIC_HANDLE_STRUCT *ptNext;
+	char *pcConfigKey;
+	rd_kafka_topic_t *ptTopic;
+} KAFKA_TOPIC_HANDLE_T;
+
+
+/* This is the state of one topic name in a core. It belongs to the core and
+ * lives as long as the core. This makes it safe to use in delivery reports
+ * which arrive after the Topic object is gone.
+ */
+typedef struct KAFKA_TOPIC_STATE_STRUCT
+{
+	struct KAFKA_TOPIC_STATE_STRUCT *ptNext;
+	char *pcName;
+	KAFKA_DELIVERY_STATISTICS_T tStatistics;
+	/* The latency histogram is allocated with the first delivered message. */
+	KAFKA_LATENCY_HISTOGRAM_T *ptLatency;
+	/* This is the registry reference of the LUA delivery callback for the
+	 * topic or LUA_NOREF.
+	 */
+	int iDeliveryCallback;
+	/* This counts the changes of the delivery callback. A Topic object
+	 * only removes the callback if it is still the one it installed.
+	 */
+	unsigned int uiDeliveryCallbackGeneration;
+	/* This is the sequence number for the next message. It is counted for
+	 * the topic name like the statistics, so "last_acked" matches the
+	 * numbers of all Topic objects with this name.
+	 */
+	uintptr_t uiSequenceNr;
+	/* These are the librdkafka handles for the topic. */
+	KAFKA_TOPIC_HANDLE_T *ptHandles;
+} KAFKA_TOPIC_STATE_T;
+
+
+/* This is the maximum number of delivery reports which are kept for the
+ * next poll_reports. Further reports are counted as lost.
+ */
+#define KAFKA_PENDING_REPORTS_MAX 65536
+
+/* This is one delivery report in the compact form. */
+typedef struct KAFKA_DELIVERY_REPORT_STRUCT
+{
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+	uintptr_t uiSequenceNr;
+	rd_kafka_resp_err_t tError;
+	int32_t iPartition;
+	int64_t llOffset;
+} KAFKA_DELIVERY_REPORT_T;
+
+
+/* This is the per-message opaque data. It is passed to librdkafka with each
+ * message and comes back in the delivery report.
+ */
+typedef struct KAFKA_MESSAGE_OPAQUE_STRUCT
+{
+	struct KAFKA_MESSAGE_OPAQUE_STRUCT *ptNext;
+	KAFKA_TOPIC_STATE_T *ptTopicState;
+	uintptr_t uiSequenceNr;
+	/* The LUA state and the reference of an anchored LUA string for the
+	 * zero-copy mode. The reference is LUA_NOREF if the payload was copied.
+	 */
+	lua_State *ptLuaState;
+	int iLuaReference;
+} KAFKA_MESSAGE_OPAQUE_T;
+
+
+/* This is one delivery report on its way from the background thread to the
+ * LUA thread.
+ */
+typedef struct KAFKA_RING_ENTRY_STRUCT
+{
+	KAFKA_MESSAGE_OPAQUE_T *ptOpaque;
+	rd_kafka_resp_err_t tError;
+	int32_t iPartition;
+	int64_t llOffset;
+	size_t sizLength;
+	int64_t llLatency;
+} KAFKA_RING_ENTRY_T;
+
+
+/* Do not include "windows.h" here, a thread handle is just a pointer. */
+#if defined(_WIN32)
+typedef void * KAFKA_THREAD_T;
+#else
+typedef pthread_t KAFKA_THREAD_T;
+#endif
+
+
 class RdKafkaCore
 {
 public:
 	RdKafkaCore(void);
 	~RdKafkaCore(void);
 
-	void createCore(const char *pcBrokerList, lua_State *ptLuaState, lua_State *ptLuaStateForConfig, int iConfigTableIndex);
+	void createCore(rd_kafka_type_t tType, const char *pcBrokerList, const char *pcGroupId, lua_State *ptLuaState, lua_State *ptLuaStateForConfig, int iConfigTableIndex);
 
 	void reference(void);
 	void dereference(void);
 
+	static RdKafkaCore *getSharedCore(const char *pcKey);
+	void setShared(const char *pcKey);
+
 	static void messageCallbackStatic(rd_kafka_t *ptRk, const rd_kafka_message_t *ptRkMessage, void *pvOpaque);
 	void messageCallback(rd_kafka_t *ptRk, const rd_kafka_message_t *ptRkMessage);
 
 	static void errorCallbackStatic(rd_kafka_t *ptRk, int iErr, const char *pcReason, void *pvOpaque);
 	void errorCallback(rd_kafka_t *ptRk, int iErr, const char *pcReason);
 
+	static int statsCallbackStatic(rd_kafka_t *ptRk, char *pcJson, size_t sizJson, void *pvOpaque);
+	int statsCallback(char *pcJson, size_t sizJson);
+
 	rd_kafka_t *_getRk(void);
+	rd_kafka_type_t getType(void);
+
+	KAFKA_MESSAGE_OPAQUE_T *allocateMessageOpaque(KAFKA_TOPIC_STATE_T *ptTopicState, uintptr_t uiSequenceNr);
+	void releaseMessageOpaque(KAFKA_MESSAGE_OPAQUE_T *ptOpaque);
+
+	KAFKA_TOPIC_STATE_T *getTopicState(const char *pcTopic);
+	rd_kafka_topic_t *getTopicHandle(KAFKA_TOPIC_STATE_T *ptTopicState, const char *pcConfigKey);
+	bool addTopicHandle(KAFKA_TOPIC_STATE_T *ptTopicState, const char *pcConfigKey, rd_kafka_topic_t *ptTopic);
+	const KAFKA_DELIVERY_STATISTICS_T *getDeliveryStatistics(void);
+	void setVerbose(bool fVerbose);
+	bool getVerbose(void);
+	void setShard(unsigned int uiShard);
 
-	void poll(int iTimeout, void **ppvMsgOpaque, unsigned int *puiFailures);
+	void setDeliveryCallback(lua_State *ptLuaState, int iIndex, KAFKA_TOPIC_STATE_T *ptTopicState);
+
+	int poll(lua_State *ptLuaState, int iTimeout, void **ppvMsgOpaque, unsigned int *puiFailures);
+	void pollReports(lua_State *ptLuaState, int iTimeout, KAFKA_TOPIC_STATE_T *ptTopicState);
 	int flush(int iTimeout);
+
+	int startBackgroundPoll(unsigned int uiRingSize);
+	void stopBackgroundPoll(void);
+	bool pauseBackgroundPoll(void);
+	void resumeBackgroundPoll(void);
+	void backgroundPoll(void);
+
+	int getEventFd(void);
+	void enableQueueEvents(rd_kafka_queue_t *ptQueue);
+	void drainEventFd(void);
+
+	void pushStatistics(lua_State *ptLuaState);
+	void pushStatisticsJson(lua_State *ptLuaState);
+
+	bool serviceQueue(int iTimeout);
+	void getQueueStatus(int *piLength, unsigned int *puiMaxMessages, unsigned int *puiMaxKBytes);
+
+	bool hasFatalError(void);
+
+	int refreshMetadata(int iTimeout);
+	int prefetchMetadata(lua_State *ptLuaState, int iTableIndex, int iTimeout);
+	int pushMetadata(lua_State *ptLuaState, int iTimeout);
+	void setMetadataRefresh(unsigned int uiInterval);
 private:
+	void processReport(KAFKA_MESSAGE_OPAQUE_T *ptOpaque, rd_kafka_resp_err_t tError, int32_t iPartition, int64_t llOffset, size_t sizLength, int64_t llLatency);
+	size_t drainRing(void);
+	size_t waitForReports(int iTimeout);
+
+	void addReport(bool fPendingReport, KAFKA_TOPIC_STATE_T *ptTopicState, uintptr_t uiSequenceNr, rd_kafka_resp_err_t tError, int32_t iPartition, int64_t llOffset);
+	void pushReports(lua_State *ptLuaState, KAFKA_TOPIC_STATE_T *ptTopicState, bool fPendingReports);
+	void keepPendingReports(KAFKA_TOPIC_STATE_T *ptTopicState);
+	int callDeliveryCallbacks(lua_State *ptLuaState);
+
 	void setClientId(rd_kafka_conf_t *ptConf);
 	int load_conf(lua_State *lua, rd_kafka_conf_t *conf, int idx);
 
 	unsigned int m_uiReferenceCounter;
+	rd_kafka_type_t m_tType;
 	rd_kafka_t *m_ptRk;
 	unsigned int m_uiFailures;
 	void *m_pvMsgOpaque;
+
+	/* This is a list of unused message opaque structures. */
+	KAFKA_MESSAGE_OPAQUE_T *m_ptFreeMessageOpaques;
+
+	/* This is a list of all topic names used with this core. */
+	KAFKA_TOPIC_STATE_T *m_ptTopicStates;
+
+	/* These are the delivery counters for all messages of this core. */
+	KAFKA_DELIVERY_STATISTICS_T m_tStatistics;
+
+	/* Print each delivery report if this is true. */
+	bool m_fVerbose;
+
+	/* This is the number of the core in a sharded producer, starting at 1.
+	 * The delivery reports get it in the field "shard" as each shard counts
+	 * its own sequence numbers. It is 0 for all other cores.
+	 */
+	unsigned int m_uiShard;
+
+	/* Collect all delivery reports in this buffer if m_fCollectReports is
+	 * true. The buffer grows on demand and is reused for all polls.
+	 */
+	bool m_fCollectReports;
+	KAFKA_DELIVERY_REPORT_T *m_ptReports;
+	size_t m_sizReports;
+	size_t m_sizReportsMax;
+	unsigned long m_ulReportsLost;
+
+	/* Reports which were not returned by a poll_reports yet are kept in
+	 * this buffer. These are failed messages which are reported somewhere
+	 * else, for example in "flush", "poll" or a "send" which waits for room
+	 * in the queue. A poll_reports of a Topic also keeps the reports of all
+	 * other topics here. The next poll_reports returns them before its own
+	 * reports. The reports are only kept after the first poll_reports. A
+	 * producer which never calls it does not fill the buffer.
+	 */
+	bool m_fReportsPolled;
+	KAFKA_DELIVERY_REPORT_T *m_ptPendingReports;
+	size_t m_sizPendingReports;
+	size_t m_sizPendingReportsMax;
+
+	/* These are the LUA delivery callbacks. m_iDeliveryCallback is the
+	 * registry reference of the callback for all messages.
+	 * m_uiTopicCallbacks counts the topic states with a callback.
+	 * The callbacks live in the registry of m_ptCallbackLuaState.
+	 */
+	lua_State *m_ptCallbackLuaState;
+	int m_iDeliveryCallback;
+	unsigned int m_uiTopicCallbacks;
+	bool m_fInDeliveryCallback;
+
+	/* In the background mode a native thread calls rd_kafka_poll. The
+	 * delivery callback only writes the reports to the ring. The LUA thread
+	 * processes them in "poll". The ring has one writer and one reader.
+	 * m_sizRingHead is only written by the background thread, m_sizRingTail
+	 * is only written by the LUA thread. Calls which serve the delivery
+	 * callback in the LUA thread must pause the background thread, or the
+	 * ring would get a second writer. m_fBackgroundPoll is read by the
+	 * delivery callback in both threads and accessed with atomics.
+	 */
+	bool m_fBackgroundPoll;
+	KAFKA_THREAD_T m_tBackgroundThread;
+	int m_iBackgroundStop;
+	int m_iBackgroundFinished;
+	KAFKA_RING_ENTRY_T *m_ptRing;
+	size_t m_sizRingMask;
+	size_t m_sizRingHead;
+	size_t m_sizRingTail;
+
+	/* librdkafka writes to this pipe if new events arrive in the queue
+	 * m_ptEventQueue. The read end is passed to the LUA event loop.
+	 */
+	int m_aiEventPipe[2];
+	rd_kafka_queue_t *m_ptEventQueue;
+
+	/* These are the limits of the local producer queue from the
+	 * configuration.
+	 */
+	unsigned int m_uiQueueMaxMessages;
+	unsigned int m_uiQueueMaxKBytes;
+
+	/* The statistics callback can run in the background thread. It passes
+	 * a new JSON document in m_pcStatisticsPending. The LUA thread moves it
+	 * to m_pcStatistics which belongs to the LUA thread alone.
+	 */
+	char *m_pcStatisticsPending;
+	char *m_pcStatistics;
+
+	/* This is set by the error callback if the handle has a fatal error.
+	 * It can run in the background thread.
+	 */
+	int m_iFatalError;
+
+	/* A shared core has a key and is in the list of all shared cores. The
+	 * key is NULL for a private core.
+	 */
+	char *m_pcSharedKey;
+	RdKafkaCore *m_ptNextShared;
+
+	/* This is the cached cluster metadata. It is requested again if it is
+	 * older than m_uiMetadataRefresh milliseconds.
+	 */
+	const struct rd_kafka_metadata *m_ptMetadata;
+	uint64_t m_ullMetadataTime;
+	unsigned int m_uiMetadataRefresh;
 };
 #endif
 
@@ -76,13 +371,21 @@ public:
 	Topic(RdKafkaCore *ptCore, lua_State *ptLuaState, const char *pcTopic, lua_State *ptLuaStateForConfig, int iConfigTableIndex);
 	~Topic(void);
 
-	RESULT_INT_WITH_ERR send(int iPartition, const char *pcMessage);
-
-	void poll(uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout=0);
+	RESULT_INT_WITH_ERR send(lua_State *MUHKUH_LUA_STATE, int iPartition, const char *pcBUFFER_IN, size_t sizBUFFER_IN, int iBUFFER_INDEX, int iLUA_INDEX_OPTIONAL, int iLUA_TABLE_INDEX_OPTIONAL);
+	void set_zero_copy(bool fZeroCopy, unsigned int uiMinimumSize=0);
+	void set_send_timeout(int iTimeout);
+	void send_batch(lua_State *ptLuaStateForTableAccess, lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, int iPartition=RD_KAFKA_PARTITION_UA);
+
+	void poll(lua_State *MUHKUH_LUA_STATE, uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout=0);
+	void poll_reports(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout=0);
+	void set_delivery_callback(lua_State *MUHKUH_LUA_STATE, int iLUA_INDEX_OPTIONAL);
+	void get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_latency(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void reset_latency(void);
 	const char *error2string(int iError);
 
 #ifndef SWIG
-	void onMessage(const rd_kafka_message_t *ptRkMessage);
+	const KAFKA_DELIVERY_STATISTICS_T *_getDeliveryStatistics(void);
 
 private:
 	int load_topic_conf(lua_State *ptLua, rd_kafka_topic_conf_t *ptConf, int idx);
@@ -91,27 +394,253 @@ private:
 	char *m_pcTopic;
 	rd_kafka_topic_t *m_ptTopic;
 	rd_kafka_t *m_ptRk;
-	uintptr_t m_uiSequenceNr;
+	KAFKA_TOPIC_STATE_T *m_ptTopicState;
+	bool m_fHasDeliveryCallback;
+	unsigned int m_uiDeliveryCallbackGeneration;
+	bool m_fZeroCopy;
+	size_t m_sizZeroCopyMinimum;
+	int m_iSendTimeout;
+
+	/* These buffers are used by send_batch. They grow on demand and are
+	 * reused for all following batches.
+	 */
+	rd_kafka_message_t *m_ptBatchMessages;
+	unsigned int *m_puiBatchIndex;
+	size_t m_sizBatchMax;
 #endif
 };
 
 
 
+class Consumer;
+
 class Producer
 {
 public:
-	Producer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, lua_State *ptLuaStateForTableAccessOptional);
+	Producer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, lua_State *ptLuaStateForTableAccessOptional, bool fBOOL_OPTIONAL);
 	~Producer(void);
 
-	void poll(uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout=0);
+	void poll(lua_State *MUHKUH_LUA_STATE, uintptr_t *puiUINT_OR_NIL, unsigned int *puiUINT_OUT, int iTimeout=0);
+	void poll_reports(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout=0);
+	void set_delivery_callback(lua_State *MUHKUH_LUA_STATE, int iLUA_INDEX_OPTIONAL);
 	RESULT_INT_WITH_ERR flush(int iTimeout);
+	void get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void set_verbose(bool fVerbose);
 	const char *error2string(int iError);
 
+	RESULT_INT_WITH_ERR start_background_poll(unsigned int uiRingSize=65536);
+	void stop_background_poll(void);
+	void get_event_fd(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void queue_status(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_stats_json(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+
 	Topic *create_topic(lua_State *MUHKUH_LUA_STATE, const char *pcTopic, lua_State *ptLuaStateForTableAccessOptional);
 
+	RESULT_INT_WITH_ERR prefetch_metadata(lua_State *ptLuaStateForTableAccess, int iTimeout=5000);
+	void get_metadata(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, int iTimeout=5000);
+	void set_metadata_refresh(unsigned int uiInterval);
+
+	RESULT_INT_WITH_ERR init_transactions(int iTimeout=30000);
+	RESULT_INT_WITH_ERR begin_transaction(void);
+	RESULT_INT_WITH_ERR send_offsets_to_transaction(Consumer *ptConsumer, int iTimeout=30000);
+	RESULT_INT_WITH_ERR commit_transaction(int iTimeout=30000);
+	RESULT_INT_WITH_ERR abort_transaction(int iTimeout=30000);
+	void get_transaction_error(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_fatal_error(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR);
+
 #ifndef SWIG
 private:
+	int setTransactionError(rd_kafka_error_t *ptError);
+
 	RdKafkaCore *m_ptCore;
+
+	/* This is the result of the last transaction call. m_pcTransactionError
+	 * is NULL if the call succeeded.
+	 */
+	rd_kafka_resp_err_t m_tTransactionError;
+	char *m_pcTransactionError;
+	bool m_fTransactionErrorIsFatal;
+	bool m_fTransactionErrorIsRetriable;
+	bool m_fTransactionErrorRequiresAbort;
+#endif
+};
+
+
+
+/* This is a topic of a ShardedProducer. It has one Topic for each shard. A
+ * message with a key always goes to the same shard, which keeps the order
+ * of the messages with the same key. Messages without a key are spread
+ * over the shards round-robin.
+ */
+class ShardedTopic
+{
+public:
+#ifndef SWIG
+	ShardedTopic(RdKafkaCore **pptCores, unsigned int uiShards, lua_State *ptLuaState, const char *pcTopic, lua_State *ptLuaStateForConfig, int iConfigTableIndex);
+#endif
+	~ShardedTopic(void);
+
+	RESULT_INT_WITH_ERR send(lua_State *MUHKUH_LUA_STATE, int iPartition, const char *pcBUFFER_IN, size_t sizBUFFER_IN, int iBUFFER_INDEX, int iLUA_INDEX_OPTIONAL, int iLUA_TABLE_INDEX_OPTIONAL);
+	void send_batch(lua_State *ptLuaStateForTableAccess, lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT_PAIR, int iPartition=RD_KAFKA_PARTITION_UA);
+	void set_zero_copy(bool fZeroCopy, unsigned int uiMinimumSize=0);
+	void set_send_timeout(int iTimeout);
+	void get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	const char *error2string(int iError);
+
+#ifndef SWIG
+private:
+	unsigned int getShard(const char *pcKey, size_t sizKey);
+
+	Topic **m_pptTopics;
+	unsigned int m_uiShards;
+	unsigned int m_uiNextShard;
+#endif
+};
+
+
+
+/* This producer has several librdkafka handles. Each handle has its own
+ * threads, which spreads a very high message rate over more cores.
+ */
+class ShardedProducer
+{
+public:
+	ShardedProducer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, unsigned int uiShards, lua_State *ptLuaStateForTableAccessOptional);
+	~ShardedProducer(void);
+
+	RESULT_UINT shards(void);
+	RESULT_UINT poll(lua_State *MUHKUH_LUA_STATE, int iTimeout=0);
+	void set_delivery_callback(lua_State *MUHKUH_LUA_STATE, int iLUA_INDEX_OPTIONAL);
+	RESULT_INT_WITH_ERR flush(int iTimeout);
+	void get_delivery_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	RESULT_INT_WITH_ERR start_background_poll(unsigned int uiRingSize=65536);
+	void stop_background_poll(void);
+	const char *error2string(int iError);
+
+	ShardedTopic *create_topic(lua_State *MUHKUH_LUA_STATE, const char *pcTopic, lua_State *ptLuaStateForTableAccessOptional);
+
+#ifndef SWIG
+private:
+	RdKafkaCore **m_pptCores;
+	unsigned int m_uiShards;
+#endif
+};
+
+
+
+/* This is a view on a consumed message. The payload and the key stay in the
+ * librdkafka buffer until they are requested.
+ */
+class Message
+{
+public:
+#ifndef SWIG
+	Message(RdKafkaCore *ptCore, rd_kafka_message_t *ptRkMessage);
+#endif
+	~Message(void);
+
+	void value(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void key(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	RESULT_UINT len(void);
+	void sub(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, long lStart, long lEnd=-1);
+	void header(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, const char *pcName);
+	void headers(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void offset(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	RESULT_UINT partition(void);
+	void topic(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void timestamp(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void error(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void release(void);
+
+#ifndef SWIG
+	const rd_kafka_message_t *_getRkMessage(void);
+
+private:
+	RdKafkaCore *m_ptCore;
+	rd_kafka_message_t *m_ptRkMessage;
+#endif
+};
+
+
+
+class Consumer
+{
+public:
+	Consumer(lua_State *MUHKUH_LUA_STATE, const char *pcBrokerList, const char *pcGroupId, lua_State *ptLuaStateForTableAccessOptional);
+	~Consumer(void);
+
+	RESULT_INT_WITH_ERR subscribe(lua_State *ptLuaStateForTableAccess);
+	RESULT_INT_WITH_ERR unsubscribe(void);
+	RESULT_INT_WITH_ERR assign(lua_State *ptLuaStateForTableAccess);
+	void consume(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout=0);
+	RESULT_UINT consume_batch(unsigned int uiMaxMessages, int iTimeout, lua_State *ptLuaStateForTableAccess);
+	Message *consume_view(int iTimeout=0);
+
+	RESULT_INT_WITH_ERR store_offset(Message *ptMessage);
+	RESULT_INT_WITH_ERR store_offset(const char *pcTopic, int iPartition, int64_t llOffset);
+	RESULT_INT_WITH_ERR commit_async(void);
+	void poll(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT, int iTimeout=0);
+	void get_event_fd(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_stats(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	void get_stats_json(lua_State *MUHKUH_SWIG_OUTPUT_CUSTOM_OBJECT);
+	const char *error2string(int iError);
+
+#ifndef SWIG
+	static void commitCallbackStatic(rd_kafka_t *ptRk, rd_kafka_resp_err_t tError, rd_kafka_topic_partition_list_t *ptOffsets, void *pvOpaque);
+	void commitCallback(rd_kafka_resp_err_t tError, rd_kafka_topic_partition_list_t *ptOffsets);
+
+	rd_kafka_t *_getRk(void);
+	rd_kafka_topic_partition_list_t *_getPendingOffsets(void);
+	void _clearPendingOffsets(void);
+
+private:
+	RdKafkaCore *m_ptCore;
+	rd_kafka_t *m_ptRk;
+	rd_kafka_queue_t *m_ptQueue;
+
+	/* These are the offsets stored since the last commit. There is only one
+	 * entry per partition, it has the highest stored offset.
+	 */
+	rd_kafka_topic_partition_list_t *m_ptPendingOffsets;
+
+	/* The results of asynchronous commits arrive in this queue. They are
+	 * collected by "poll" in the table at the top of m_ptPollLuaState.
+	 */
+	rd_kafka_queue_t *m_ptCommitQueue;
+	lua_State *m_ptPollLuaState;
+	unsigned int m_uiCommitsInFlight;
+
+	/* This buffer is used by consume_batch. It grows on demand and is
+	 * reused for all following batches.
+	 */
+	rd_kafka_message_t **m_pptBatchMessages;
+	size_t m_sizBatchMax;
+#endif
+};
+
+
+
+/* This is a mock cluster from librdkafka. It runs in the process and needs
+ * no broker. Pass "bootstrap_servers" as the broker list to a Producer or
+ * Consumer.
+ */
+class MockCluster
+{
+public:
+	MockCluster(lua_State *MUHKUH_LUA_STATE, unsigned int uiBrokers=1);
+	~MockCluster(void);
+
+	const char *bootstrap_servers(void);
+	RESULT_INT_WITH_ERR create_topic(const char *pcTopic, int iPartitions=1, int iReplicationFactor=1);
+	const char *error2string(int iError);
+
+#ifndef SWIG
+private:
+	/* The mock cluster needs a handle for its threads. */
+	rd_kafka_t *m_ptRk;
+	rd_kafka_mock_cluster_t *m_ptCluster;
 #endif
 };
 